@@ -0,0 +1,26 @@
+#include "optparser.hpp"
+#include <ctype.h>
+
+static char* trim(char* s) {
+    while (*s && isspace((unsigned char)*s)) s++;
+    char* e = s + strlen(s);
+    while (e > s && isspace((unsigned char)e[-1])) *--e = 0;
+    return s;
+}
+
+void OptParser::get(char* p_options, const char p_sep, TValueCallback p_callback) {
+    uint16_t pos = 0;
+    char* p = p_options;
+    while (p && *p) {
+        char* end = strchr(p, p_sep);
+        if (end) *end = 0;
+        char* tok = trim(p);
+        if (*tok) {
+            char* eq = strchr(tok, '=');
+            const char* value = "";
+            if (eq) { *eq = 0; value = trim(eq + 1); }
+            p_callback(OptValue(pos++, trim(tok), value));
+        }
+        p = end ? end + 1 : nullptr;
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+// Local stand-in for https://github.com/rvt/opt-parser (not part of the repo)
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+
+class OptValue {
+private:
+    const uint16_t m_pos;
+    const char* m_key;
+    const char* m_value;
+public:
+    OptValue(const uint16_t p_pos, const char* p_key, const char* p_value) :
+        m_pos(p_pos), m_key(p_key), m_value(p_value) {}
+    const char* key() const { return m_key; }
+    uint16_t pos() const { return m_pos; }
+    operator long() const { return atol(m_value); }
+    operator int32_t() const { return atol(m_value); }
+    operator int16_t() const { return atoi(m_value); }
+    operator uint8_t() const { return atoi(m_value); }
+    operator float() const { return atof(m_value); }
+    operator char* () const { return (char*)m_value; }
+};
+
+class OptParser {
+public:
+    typedef std::function<void(const OptValue&)> TValueCallback;
+    static void get(char* p_options, const char p_sep, TValueCallback p_callback);
+};
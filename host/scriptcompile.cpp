@@ -0,0 +1,81 @@
+/**
+ * Translates a script into a C++ header, for scripts that are built into the firmware and never change.
+ *
+ * usage: scriptcompile [-n name] script > script.hpp
+ *   -n name  name of the generated functions, defaults to the file name of the script
+ *
+ * The header has name(context) which makes a context, created without a script, run the translated script
+ * on any ScriptRunner with the same commands as the interpreted script
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+
+#include <scriptprogram.hpp>
+#include <codegenerator.hpp>
+
+using namespace rvt::scriptrunner;
+
+static bool readFile(const char* path, std::string& text) {
+    FILE* file = fopen(path, "rb");
+
+    if (file == nullptr) {
+        return false;
+    }
+
+    char buffer[512];
+    size_t size;
+
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        text.append(buffer, size);
+    }
+
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    const char* name = nullptr;
+    int option;
+
+    while ((option = getopt(argc, argv, "n:")) != -1) {
+        switch (option) {
+            case 'n':
+                name = optarg;
+                break;
+
+            default:
+                fprintf(stderr, "usage: %s [-n name] script\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        fprintf(stderr, "usage: %s [-n name] script\n", argv[0]);
+        return 1;
+    }
+
+    const char* path = argv[optind];
+    std::string text;
+
+    if (!readFile(path, text)) {
+        perror(path);
+        return 1;
+    }
+
+    if (name == nullptr) {
+        const char* slash = strrchr(path, '/');
+        name = slash == nullptr ? path : slash + 1;
+    }
+
+    std::string base = name;
+    base = base.substr(0, base.find('.'));
+
+    Program program{text.c_str()};
+    program.optimize();
+    CodeGenerator generator;
+    fputs(generator.generate(CodeGenerator::identifier(base.c_str()).c_str(), program).c_str(), stdout);
+    return 0;
+}
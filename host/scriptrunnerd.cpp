@@ -0,0 +1,115 @@
+/**
+ * Runs all scripts in a directory on a Linux host, for bench rigs and test tools.
+ * Scripts are reloaded when their file changes, the process sleeps while all scripts wait.
+ *
+ * usage: scriptrunnerd [-s slack] directory
+ *   -s slack  timer slack in milli seconds given to every script, so close wake ups are handled together
+ *
+ * Besides the built-in instructions scripts can use
+ *   print=text     print text, prefixed with the name of the script
+ *   signal=event   wake all scripts waiting for event
+ *   await=event    wait until another script signals event
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include <scriptrunner.hpp>
+#include <directoryrunner.hpp>
+
+using namespace rvt::scriptrunner;
+
+extern "C" uint32_t millis() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000UL + now.tv_nsec / 1000000L;
+}
+
+extern "C" uint32_t micros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000UL + now.tv_nsec / 1000L;
+}
+
+class HostContext : public Context {
+public:
+    std::string name;
+    HostContext(const char* script) : Context(script) {
+    }
+};
+
+static DirectoryRunner<HostContext>* s_runner = nullptr;
+
+static void stopRunner(int) {
+    if (s_runner != nullptr) {
+        s_runner->stop();
+    }
+}
+
+int main(int argc, char** argv) {
+    uint16_t slack = 0;
+    int option;
+
+    while ((option = getopt(argc, argv, "s:")) != -1) {
+        switch (option) {
+            case 's':
+                slack = atoi(optarg);
+                break;
+
+            default:
+                fprintf(stderr, "usage: %s [-s slack] directory\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        fprintf(stderr, "usage: %s [-s slack] directory\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<Command<HostContext>*> commands;
+    commands.push_back(new Command<HostContext>("print", [](const OptValue & value, HostContext & context) {
+        printf("%s: %s\n", context.name.c_str(), (char*)value);
+        fflush(stdout);
+        return true;
+    }));
+    commands.push_back(new Command<HostContext>("signal", [](const OptValue & value, HostContext&) {
+        s_runner->runner().signal((char*)value);
+        return true;
+    }));
+    commands.push_back(new Command<HostContext>("await", [](const OptValue & value, HostContext & context) {
+        return context.waitFor((char*)value);
+    }));
+
+    DirectoryRunner<HostContext> runner(commands, argv[optind]);
+
+    if (!runner.valid()) {
+        perror("scriptrunnerd");
+        return 1;
+    }
+
+    runner.onLoaded([slack](const char* name, HostContext & context) {
+        context.name = name;
+        context.setTimerSlack(slack);
+        // Event names are looked up while running, so they are interned here
+        context.program().internValues("await");
+        fprintf(stderr, "loaded %s\n", name);
+    });
+
+    s_runner = &runner;
+    signal(SIGINT, stopRunner);
+    signal(SIGTERM, stopRunner);
+    runner.run();
+    s_runner = nullptr;
+
+    for (auto command : commands) {
+        delete command;
+    }
+
+    return 0;
+}
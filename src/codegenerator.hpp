@@ -0,0 +1,314 @@
+#pragma once
+/**
+ * Host side, translates a script into C++ for scripts that don't change between firmware releases
+ */
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+
+#include "scriptprogram.hpp"
+
+namespace rvt {
+
+namespace scriptrunner {
+
+/**
+ * Writes an optimized program as a C++ state machine, one case per line with jumps, loops and waits resolved.
+ * For a script named brew the generated header has brewStep(), a single tick of the script, and brew(context)
+ * which makes a context run it. The context is then handled by the same ScriptRunner and commands as any other:
+ *
+ *   Context context;
+ *   brew(context);
+ *   runner.start(context);
+ *
+ * Only commands are dispatched at runtime, built-in instructions are inlined. Commands named like a built-in
+ * instruction are not called for those lines, unlike with the interpreter.
+ * The names of the commands are interned by brew(context), so a tick never adds to the SymbolTable
+ */
+class CodeGenerator {
+    std::string m_code;
+    // Keys of the command lines, their SymbolId's are resolved when a context is set up instead of on a tick
+    std::vector<std::string> m_commands;
+
+    size_t commandIndex(const char* key) {
+        for (size_t i = 0; i < m_commands.size(); i++) {
+            if (m_commands[i] == key) {
+                return i;
+            }
+        }
+
+        m_commands.push_back(key);
+        return m_commands.size() - 1;
+    }
+
+    void append(const char* format, ...) {
+        char buffer[256];
+        va_list args;
+        va_start(args, format);
+        int size = vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+
+        if (size < static_cast<int>(sizeof(buffer))) {
+            m_code += buffer;
+            return;
+        }
+
+        std::string text(size + 1, '\0');
+        va_start(args, format);
+        vsnprintf(&text[0], text.size(), format, args);
+        va_end(args);
+        m_code.append(text.c_str(), size);
+    }
+
+    /**
+     * C string literal of text
+     */
+    static std::string quote(const char* text) {
+        std::string quoted = "\"";
+
+        for (; *text; text++) {
+            unsigned char c = *text;
+
+            if (c == '"' || c == '\\') {
+                quoted += '\\';
+                quoted += c;
+            } else if (c < ' ' || c > '~') {
+                char escaped[5];
+                snprintf(escaped, sizeof(escaped), "\\%03o", c);
+                quoted += escaped;
+            } else {
+                quoted += c;
+            }
+        }
+
+        return quoted + "\"";
+    }
+
+    static std::string operand(const ScriptOperands& operands) {
+        char text[32];
+
+        if (operands.m_source == ScriptOperands::NO_REGISTER) {
+            snprintf(text, sizeof(text), "%ld", static_cast<long>(operands.m_immediate));
+        } else {
+            snprintf(text, sizeof(text), "context.registerValue(%u)", operands.m_source);
+        }
+
+        return text;
+    }
+
+    template<typename Allocator>
+    void writeLine(const char* name, const BasicProgram<Allocator>& program, size_t index) {
+        const ScriptLine& line = program.line(index);
+        unsigned next = index + 1;
+        append("        case %u:", static_cast<unsigned>(index));
+
+        switch (line.m_opcode) {
+            case Opcode::END:
+                append("\n            return false;\n\n");
+                return;
+
+            case Opcode::GOTO:
+                append("\n            return context.stepTo(%u);\n\n", line.m_value);
+                return;
+
+            case Opcode::GOSUB:
+                append("\n            return context.stepCall(%u, %u);\n\n", line.m_value, next);
+                return;
+
+            case Opcode::RETURN:
+                append("\n            return context.stepReturn();\n\n");
+                return;
+
+            case Opcode::JUMP:
+            case Opcode::CALL:
+                // The label does not exist, like the interpreter we stay on this line
+                append("\n            return true;\n\n");
+                return;
+
+            case Opcode::WAIT:
+                append("\n            return context.stepWait(%luUL, %u);\n\n",
+                       static_cast<unsigned long>(static_cast<uint32_t>(atol(program.value(line)))), next);
+                return;
+
+            case Opcode::SET:
+            case Opcode::ADD:
+            case Opcode::CMP: {
+                const ScriptOperands& operands = program.operands(line.m_value);
+
+                if (line.m_opcode == Opcode::SET) {
+                    append("\n            context.setRegister(%u, %s);\n", operands.m_register, operand(operands).c_str());
+                } else if (line.m_opcode == Opcode::ADD) {
+                    append("\n            context.setRegister(%u, static_cast<int32_t>(static_cast<uint32_t>(context.registerValue(%u)) +"
+                           " static_cast<uint32_t>(%s)));\n", operands.m_register, operands.m_register, operand(operands).c_str());
+                } else {
+                    append("\n            return context.stepCompare(context.registerValue(%u), %s, %u);\n\n",
+                           operands.m_register, operand(operands).c_str(), next);
+                    return;
+                }
+
+                append("            return context.stepTo(%u);\n\n", next);
+                return;
+            }
+
+            case Opcode::BRANCH: {
+                std::string condition = program.key(line);
+
+                for (auto& c : condition) {
+                    c = toupper(c);
+                }
+
+                append("\n            return context.stepTo(context.condition(SymbolTable::%s) ? %u : %u);\n\n",
+                       condition.c_str(), line.m_value, next);
+                return;
+            }
+
+            case Opcode::SWITCH: {
+                const ScriptSwitch& table = program.jumpTable(line.m_value);
+                append("\n            switch (context.registerValue(%u)) {\n", table.m_register);
+
+                for (size_t i = 0; i < table.m_count; i++) {
+                    append("                case %u:\n                    return context.stepTo(%u);\n\n",
+                           static_cast<unsigned>(i), program.switchTarget(line.m_value, i));
+                }
+
+                append("                default:\n                    return context.stepTo(%u);\n            }\n\n", next);
+                return;
+            }
+
+            case Opcode::REPEAT:
+                append("\n            return context.stepRepeat(%u, %lu, %u);\n\n", line.m_value,
+                       static_cast<unsigned long>(program.loop(line.m_value).m_count), next);
+                return;
+
+            case Opcode::ENDREPEAT:
+                append("\n            return context.stepEndRepeat(%u, %u, %u);\n\n", line.m_value,
+                       program.loop(line.m_value).m_body, next);
+                return;
+
+            case Opcode::LABEL:
+                append("\n            return context.stepTo(%u);\n\n", next);
+                return;
+
+            default:
+                append(" {\n"
+                       "            static const OptValue line(%u, %s, %s);\n"
+                       "            return commands.command(context, %sSymbols()[%u], line, %u);\n"
+                       "        }\n\n",
+                       static_cast<unsigned>(index), quote(program.key(line)).c_str(), quote(program.value(line)).c_str(),
+                       name, static_cast<unsigned>(commandIndex(program.key(line))), next);
+        }
+    }
+
+public:
+    /**
+     * Name usable as C++ identifier, other characters become _
+     */
+    static std::string identifier(const char* name) {
+        std::string result = isdigit(static_cast<unsigned char>(*name)) || *name == '\0' ? "_" : "";
+
+        for (; *name; name++) {
+            result += isalnum(static_cast<unsigned char>(*name)) ? *name : '_';
+        }
+
+        return result;
+    }
+
+    /**
+     * Header with the C++ for program, which must be optimized. name must be an identifier.
+     * Included modules are not translated, the lines that run them are dispatched as commands
+     */
+    template<typename Allocator>
+    std::string generate(const char* name, const BasicProgram<Allocator>& program) {
+        m_code.clear();
+        m_commands.clear();
+
+        for (size_t i = 0; i < program.size(); i++) {
+            if (program.line(i).m_opcode == Opcode::COMMAND) {
+                commandIndex(program.key(program.line(i)));
+            }
+        }
+
+        append("/**\n"
+               " * Generated from script %s, do not edit\n"
+               " */\n"
+               "#pragma once\n"
+               "#include <scriptrunner.hpp>\n\n", name);
+
+        if (!m_commands.empty()) {
+            append("/**\n"
+                   " * SymbolId's of the commands of %s, resolved by %s(context)\n"
+                   " */\n"
+                   "inline rvt::scriptrunner::SymbolId* %sSymbols() {\n"
+                   "    static rvt::scriptrunner::SymbolId s_symbols[%u] = {};\n"
+                   "    return s_symbols;\n"
+                   "}\n\n", name, name, name, static_cast<unsigned>(m_commands.size()));
+        }
+
+        append("template<typename Allocator>\n"
+               "bool %sStep(rvt::scriptrunner::BasicContext<Allocator>& context,\n"
+               "        const typename rvt::scriptrunner::BasicContext<Allocator>::CommandDispatcher& commands) {\n"
+               "    using namespace rvt::scriptrunner;\n\n"
+               "    switch (context.lineNumber()) {\n", name);
+
+        for (size_t i = 0; i < program.size(); i++) {
+            writeLine(name, program, i);
+        }
+
+        append("        default:\n"
+               "            return false;\n"
+               "    }\n"
+               "}\n\n");
+
+        if (program.labels() != 0) {
+            append("inline bool %sLabel(const char* name, rvt::scriptrunner::ScriptOffset& line) {\n", name);
+
+            for (size_t i = 0; i < program.labels(); i++) {
+                const ScriptLabel& label = program.labelAt(i);
+                append("    if (strcmp(name, %s) == 0) {\n"
+                       "        line = %u;\n"
+                       "        return true;\n"
+                       "    }\n\n", quote(SymbolTable::instance().name(label.m_label)).c_str(), label.m_line);
+            }
+
+            append("    return false;\n"
+                   "}\n\n");
+        }
+
+        append("/**\n"
+               " * Make context run %s, create the context without a script\n"
+               " */\n"
+               "template<typename Allocator>\n"
+               "void %s(rvt::scriptrunner::BasicContext<Allocator>& context) {\n", name, name);
+
+        if (!m_commands.empty()) {
+            append("    static const char* const names[] = {");
+
+            for (size_t i = 0; i < m_commands.size(); i++) {
+                append(i == 0 ? "%s" : ", %s", quote(m_commands[i].c_str()).c_str());
+            }
+
+            append("};\n\n"
+                   "    for (size_t i = 0; i < %u; i++) {\n"
+                   "        %sSymbols()[i] = rvt::scriptrunner::SymbolTable::instance().intern(names[i]);\n"
+                   "    }\n\n", static_cast<unsigned>(m_commands.size()), name);
+        }
+
+        if (program.labels() == 0) {
+            append("    context.setCompiledScript(&%sStep<Allocator>, %u, nullptr);\n", name,
+                   static_cast<unsigned>(program.loops()));
+        } else {
+            append("    context.setCompiledScript(&%sStep<Allocator>, %u, &%sLabel);\n", name,
+                   static_cast<unsigned>(program.loops()), name);
+        }
+
+        append("}\n");
+        return m_code;
+    }
+};
+
+}
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <stddef.h>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace rvt {
+
+namespace scriptrunner {
+
+/**
+ * Keeps contexts around after their script has finished so the next run
+ * of the same script can reuse them without parsing and allocating again.
+ * Scripts are identified by the address of their text, this text must stay valid
+ * for the lifetime of the pool (string literals, PROGMEM and other constants)
+ * ContextType must be constructable from the script text, or from the script text and an Allocator.
+ * The entries and the contexts are obtained from Allocator, contexts that take an allocator get it as well
+ */
+template<typename ContextType, typename Allocator = std::allocator<char>>
+class ContextPool {
+    struct Entry {
+        const char* m_script;
+        ContextType* m_context;
+        bool m_inUse;
+    };
+
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<Entry> EntryAllocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<ContextType> ContextAllocator;
+    typedef std::allocator_traits<ContextAllocator> ContextTraits;
+    std::vector<Entry, EntryAllocator> m_entries;
+    ContextAllocator m_allocator;
+
+    void construct(ContextType* context, const char* script, std::true_type) {
+        ContextTraits::construct(m_allocator, context, script, Allocator(m_allocator));
+    }
+
+    void construct(ContextType* context, const char* script, std::false_type) {
+        ContextTraits::construct(m_allocator, context, script);
+    }
+
+    ContextType* create(const char* script) {
+        ContextType* context = ContextTraits::allocate(m_allocator, 1);
+        construct(context, script, std::is_constructible<ContextType, const char*, const Allocator&>());
+        return context;
+    }
+
+public:
+    ContextPool(const Allocator& p_allocator = Allocator()) :
+        m_entries(EntryAllocator(p_allocator)),
+        m_allocator(p_allocator) {
+    }
+
+    ContextPool(const ContextPool&) = delete;
+    ContextPool& operator=(const ContextPool&) = delete;
+
+    ~ContextPool() {
+        for (auto& entry : m_entries) {
+            ContextTraits::destroy(m_allocator, entry.m_context);
+            ContextTraits::deallocate(m_allocator, entry.m_context, 1);
+        }
+    }
+
+    /**
+     * Get a context ready to run script, an idle context of the same script is reused
+     * when available, otherwise a new context is created
+     */
+    ContextType* acquire(const char* script) {
+        for (auto& entry : m_entries) {
+            if (!entry.m_inUse && entry.m_script == script) {
+                entry.m_inUse = true;
+                return entry.m_context;
+            }
+        }
+
+        ContextType* context = create(script);
+        m_entries.push_back(Entry{script, context, true});
+        return context;
+    }
+
+    /**
+     * Hand a context back to the pool, the context is reset so it's ready for the next run
+     */
+    void release(ContextType* context) {
+        for (auto& entry : m_entries) {
+            if (entry.m_context == context) {
+                context->reset();
+                entry.m_inUse = false;
+                return;
+            }
+        }
+    }
+
+    /**
+     * Create idle contexts up front so the first runs do not need to parse
+     */
+    void reserve(const char* script, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            m_entries.push_back(Entry{script, create(script), false});
+        }
+    }
+
+    size_t size() const {
+        return m_entries.size();
+    }
+};
+
+}
+}
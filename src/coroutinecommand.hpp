@@ -0,0 +1,462 @@
+#pragma once
+/**
+ * Optional command flavour whose handler is a C++20 coroutine.
+ * Only available when the compiler supports coroutines, the rest of the library stays C++11
+ */
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <stddef.h>
+#include <stdint.h>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "scriptrunner.hpp"
+
+namespace rvt {
+
+namespace scriptrunner {
+
+/**
+ * Stack allocator for coroutine frames, frames of nested coroutines are released in reverse order.
+ * When the buffer is full frames are taken from the heap
+ */
+class CoroutineFrameStack {
+    struct Header {
+        CoroutineFrameStack* m_stack;
+        size_t m_size;
+    };
+
+    static constexpr size_t HEADER_SIZE = (sizeof(Header) + alignof(std::max_align_t) - 1) &
+                                          ~(alignof(std::max_align_t) - 1);
+
+    unsigned char* m_buffer;
+    size_t m_size;
+    size_t m_used;
+
+public:
+    CoroutineFrameStack(void* p_buffer, size_t p_size) :
+        m_buffer(static_cast<unsigned char*>(p_buffer)),
+        m_size(p_size),
+        m_used(0) {
+    }
+
+    CoroutineFrameStack(const CoroutineFrameStack&) = delete;
+    CoroutineFrameStack& operator=(const CoroutineFrameStack&) = delete;
+
+    static void* allocate(CoroutineFrameStack* stack, size_t size) {
+        size_t total = (HEADER_SIZE + size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+        Header* header;
+
+        if (stack != nullptr && stack->m_used + total <= stack->m_size) {
+            header = reinterpret_cast<Header*>(stack->m_buffer + stack->m_used);
+            stack->m_used += total;
+            header->m_stack = stack;
+        } else {
+            header = static_cast<Header*>(::operator new (total));
+            header->m_stack = nullptr;
+        }
+
+        header->m_size = total;
+        return reinterpret_cast<unsigned char*>(header) + HEADER_SIZE;
+    }
+
+    /**
+     * Release frame. Buffer space is only reclaimed in LIFO order, when frame is the last one taken that is still
+     * in use. A frame released before frames taken after it keeps it's space until the stack is reset()
+     */
+    static void deallocate(void* frame) {
+        Header* header = reinterpret_cast<Header*>(static_cast<unsigned char*>(frame) - HEADER_SIZE);
+        CoroutineFrameStack* stack = header->m_stack;
+
+        if (stack == nullptr) {
+            ::operator delete (header);
+        } else if (reinterpret_cast<unsigned char*>(header) + header->m_size == stack->m_buffer + stack->m_used) {
+            stack->m_used -= header->m_size;
+        }
+    }
+
+    size_t used() const {
+        return m_used;
+    }
+
+    /**
+     * Reclaim the whole buffer, only when no frame is in use
+     */
+    void reset() {
+        m_used = 0;
+    }
+};
+
+/**
+ * Bookkeeping for the coroutine a context is running, see CoroutineContext
+ */
+class CoroutineState {
+    template<typename> friend class CoroutineCommand;
+    friend class CommandTask;
+    friend struct DelayAwaiter;
+    friend struct EventAwaiter;
+
+public:
+    enum class Await : uint8_t {
+        NONE,
+        DELAY,
+        EVENT
+    };
+
+private:
+    std::coroutine_handle<> m_root;
+    // Innermost coroutine, this is the one that is resumed
+    std::coroutine_handle<> m_leaf;
+    Await m_await = Await::NONE;
+    uint32_t m_resumeAt = 0;
+    SymbolId m_awaitedEvent = SymbolTable::NOT_FOUND;
+    uint32_t m_awaitedTimeout = 0;
+    bool m_eventSignalled = false;
+    CoroutineFrameStack m_frames;
+    // Copy of the line the coroutine was started for, the handler keeps a reference to it across ticks
+    alignas(OptValue) unsigned char m_line[sizeof(OptValue)];
+
+    OptValue* line() {
+        return reinterpret_cast<OptValue*>(m_line);
+    }
+
+protected:
+    CoroutineState(void* p_buffer, size_t p_size) : m_frames(p_buffer, p_size) {
+    }
+
+    ~CoroutineState() {
+        cancel();
+    }
+
+public:
+    CoroutineState(const CoroutineState&) = delete;
+    CoroutineState& operator=(const CoroutineState&) = delete;
+
+    /**
+     * Destroy the running coroutine, if any
+     */
+    void cancel() {
+        if (m_root) {
+            m_root.destroy();
+            line()->~OptValue();
+            m_root = nullptr;
+            m_leaf = nullptr;
+            // All frames are gone, also the ones released out of order
+            m_frames.reset();
+        }
+
+        m_await = Await::NONE;
+    }
+
+    bool coroutineActive() const {
+        return static_cast<bool>(m_root);
+    }
+
+    CoroutineFrameStack& frames() {
+        return m_frames;
+    }
+};
+
+/**
+ * Context that can run coroutine commands, frames are taken from a FramePoolSize byte buffer in the context
+ * Base is the context to extend, usually Context
+ */
+template<typename Base, size_t FramePoolSize = 256>
+class CoroutineContext : public Base, public CoroutineState {
+    alignas(std::max_align_t) unsigned char m_frameBuffer[FramePoolSize];
+
+public:
+    template<typename... Args>
+    CoroutineContext(Args&& ... args) :
+        Base(std::forward<Args>(args)...),
+        CoroutineState(m_frameBuffer, FramePoolSize) {
+    }
+
+    virtual void reset() override {
+        cancel();
+        Base::reset();
+    }
+};
+
+namespace detail {
+
+/**
+ * State of the context a CoroutineCommand is running on this thread, coroutine frames are taken from it's frame stack
+ */
+inline CoroutineState*& runningState() {
+    static thread_local CoroutineState* s_state = nullptr;
+    return s_state;
+}
+
+/**
+ * Makes state the running state while in scope
+ */
+class RunningState {
+    CoroutineState* m_previous;
+
+public:
+    explicit RunningState(CoroutineState* p_state) : m_previous(runningState()) {
+        runningState() = p_state;
+    }
+
+    ~RunningState() {
+        runningState() = m_previous;
+    }
+
+    RunningState(const RunningState&) = delete;
+    RunningState& operator=(const RunningState&) = delete;
+};
+
+inline CoroutineState* findState() {
+    return nullptr;
+}
+
+template<typename First, typename... Rest>
+CoroutineState* findState(First& first, Rest& ... rest) {
+    if constexpr(std::is_base_of<CoroutineState, typename std::remove_cv<First>::type>::value) {
+        return &const_cast<typename std::remove_cv<First>::type&>(first);
+    } else {
+        return findState(rest...);
+    }
+}
+
+}
+
+/**
+ * Return type of a coroutine command handler
+ * co_await delay(ms), co_await event(name, timeout) or co_await another CommandTask
+ */
+class CommandTask {
+public:
+    struct promise_type {
+        CoroutineState* m_state;
+        std::coroutine_handle<> m_continuation;
+
+        template<typename... Args>
+        promise_type(Args& ... args) : m_state(detail::findState(args...)) {
+        }
+
+        // Not a template, so the frame is allocated and released by a matching pair
+        static void* operator new (size_t size) {
+            CoroutineState* state = detail::runningState();
+            return CoroutineFrameStack::allocate(state == nullptr ? nullptr : &state->frames(), size);
+        }
+
+        static void operator delete (void* frame, size_t) {
+            CoroutineFrameStack::deallocate(frame);
+        }
+
+        CommandTask get_return_object() {
+            return CommandTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                promise_type& promise = handle.promise();
+
+                if (promise.m_continuation) {
+                    // Hand control back to the coroutine that awaited this one
+                    promise.m_state->m_leaf = promise.m_continuation;
+                    return promise.m_continuation;
+                }
+
+                return std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {
+            }
+        };
+
+        FinalAwaiter final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {
+        }
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+private:
+    std::coroutine_handle<promise_type> m_handle;
+
+    explicit CommandTask(std::coroutine_handle<promise_type> p_handle) : m_handle(p_handle) {
+    }
+
+public:
+    CommandTask(CommandTask&& p_other) noexcept : m_handle(std::exchange(p_other.m_handle, nullptr)) {
+    }
+
+    CommandTask(const CommandTask&) = delete;
+    CommandTask& operator=(const CommandTask&) = delete;
+
+    ~CommandTask() {
+        if (m_handle) {
+            m_handle.destroy();
+        }
+    }
+
+    std::coroutine_handle<promise_type> release() {
+        return std::exchange(m_handle, nullptr);
+    }
+
+    // Awaiting a task runs it as part of the awaiting coroutine
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> parent) noexcept {
+        promise_type& promise = m_handle.promise();
+        promise.m_continuation = parent;
+        promise.m_state = parent.promise().m_state;
+        promise.m_state->m_leaf = m_handle;
+        return m_handle;
+    }
+
+    void await_resume() noexcept {
+    }
+};
+
+struct DelayAwaiter {
+    uint32_t m_millis;
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<CommandTask::promise_type> handle) noexcept {
+        CoroutineState& state = *handle.promise().m_state;
+        state.m_leaf = handle;
+        state.m_await = CoroutineState::Await::DELAY;
+        state.m_resumeAt = millis() + m_millis;
+    }
+
+    void await_resume() noexcept {
+    }
+};
+
+struct EventAwaiter {
+    SymbolId m_event;
+    uint32_t m_timeout;
+    CoroutineState* m_state = nullptr;
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<CommandTask::promise_type> handle) noexcept {
+        m_state = handle.promise().m_state;
+        m_state->m_leaf = handle;
+        m_state->m_await = CoroutineState::Await::EVENT;
+        m_state->m_awaitedEvent = m_event;
+        m_state->m_awaitedTimeout = m_timeout;
+    }
+
+    /**
+     * True when the event was signalled, false when the wait timed out
+     */
+    bool await_resume() noexcept {
+        return m_state->m_eventSignalled;
+    }
+};
+
+/**
+ * Suspend the coroutine for millisToWait milli seconds, the context sleeps on the runner meanwhile
+ */
+inline DelayAwaiter delay(uint32_t millisToWait) {
+    return DelayAwaiter{millisToWait};
+}
+
+/**
+ * Suspend the coroutine until event is signalled or timeout (0 is forever) passed, the context is parked meanwhile
+ */
+inline EventAwaiter event(SymbolId event, uint32_t timeout = 0) {
+    return EventAwaiter{event, timeout};
+}
+
+/**
+ * Like waitFor() the name is only looked up, it must be interned at load time. An unknown name resumes at once as timed out
+ */
+inline EventAwaiter event(const char* name, uint32_t timeout = 0) {
+    return EventAwaiter{SymbolTable::instance().find(name), timeout};
+}
+
+/**
+ * Command whose handler is a coroutine, the handler is started when the line is reached and the
+ * context advances to the next line when it returns.
+ * ContextType must derive from CoroutineContext
+ */
+template<typename ContextType>
+class CoroutineCommand : public Command<ContextType> {
+public:
+    typedef std::function<CommandTask(const OptValue&, ContextType& context)> TCoroutineFunction;
+
+private:
+    TCoroutineFunction m_coroutine;
+
+public:
+    CoroutineCommand(const char* p_command, const TCoroutineFunction& p_coroutine) :
+        Command<ContextType>(p_command, nullptr),
+        m_coroutine(p_coroutine) {
+    }
+
+    virtual CommandResult execute(const OptValue& execLine, ContextType& context) override {
+        CoroutineState& state = context;
+        // Frames of the handler and of the coroutines it awaits are taken from the context
+        detail::RunningState running(&state);
+
+        if (!state.m_root) {
+            // The runner's line only lives for this tick
+            OptValue* line = new (state.m_line) OptValue(execLine);
+            std::coroutine_handle<> root = m_coroutine(*line, context).release();
+            state.m_root = root;
+            state.m_leaf = root;
+        } else if (state.m_await == CoroutineState::Await::EVENT) {
+            if (!context.waitFor(state.m_awaitedEvent, state.m_awaitedTimeout)) {
+                return CommandResult::retry();
+            }
+
+            state.m_eventSignalled = !context.eventTimedOut();
+        }
+
+        state.m_await = CoroutineState::Await::NONE;
+        state.m_leaf.resume();
+
+        if (state.m_root.done()) {
+            state.cancel();
+            return CommandResult::advance();
+        }
+
+        switch (state.m_await) {
+            case CoroutineState::Await::DELAY:
+                return CommandResult::sleepUntil(state.m_resumeAt);
+
+            case CoroutineState::Await::EVENT:
+                // Starts the wait, the runner parks the context until the event arrives
+                context.waitFor(state.m_awaitedEvent, state.m_awaitedTimeout);
+                return CommandResult::retry();
+
+            default:
+                return CommandResult::retry();
+        }
+    }
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,371 @@
+#pragma once
+/**
+ * Linux only, runs every script of a directory on an epoll loop
+ */
+#ifdef __linux__
+
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "scriptrunner.hpp"
+
+namespace rvt {
+
+namespace scriptrunner {
+
+/**
+ * Host side runner that loads all scripts from a directory, one context per file, and starts them on it's ScriptRunner.
+ * run() handles the runner and then sleeps in epoll until the next timer expires (timerfd), a file in the directory
+ * changed (inotify) or wake() is called, so it takes no CPU while all contexts wait.
+ * A file that is written or moved into the directory is loaded again, the old context is aborted and replaced.
+ * Hidden files and files ending with ~ are skipped.
+ * ContextType must be constructible from the script text
+ */
+template<typename ContextType = Context>
+class DirectoryRunner {
+public:
+    typedef std::function<void(const char* name, ContextType& context)> TLoadedFunction;
+
+private:
+    struct Script {
+        std::string m_name;
+        std::unique_ptr<ContextType> m_context;
+    };
+
+    enum : uint64_t {
+        TIMER_EVENT,
+        INOTIFY_EVENT,
+        WAKEUP_EVENT
+    };
+
+    ScriptRunner<ContextType> m_runner;
+    std::string m_directory;
+    std::vector<Script> m_scripts;
+    // Aborted contexts, these can only be deleted once the runner applied the abort
+    std::vector<std::unique_ptr<ContextType>> m_retired;
+    TLoadedFunction m_loaded;
+    int m_epoll;
+    int m_timer;
+    int m_inotify;
+    int m_watch;
+    int m_wakeup;
+    std::atomic<bool> m_stop;
+
+    static bool skip(const char* name) {
+        size_t length = strlen(name);
+        return length == 0 || name[0] == '.' || name[length - 1] == '~';
+    }
+
+    void watch(int fd, uint64_t id) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u64 = id;
+        epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    static void drain(int fd) {
+        char buffer[64];
+
+        while (read(fd, buffer, sizeof(buffer)) > 0) {
+        }
+    }
+
+    bool readFile(const std::string& path, std::string& text) const {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat info;
+
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+            close(fd);
+            return false;
+        }
+
+        char buffer[512];
+        ssize_t size;
+        text.clear();
+
+        while ((size = read(fd, buffer, sizeof(buffer))) > 0) {
+            text.append(buffer, size);
+        }
+
+        close(fd);
+        return size == 0;
+    }
+
+    typename std::vector<Script>::iterator find(const char* name) {
+        for (auto it = m_scripts.begin(); it != m_scripts.end(); ++it) {
+            if (it->m_name == name) {
+                return it;
+            }
+        }
+
+        return m_scripts.end();
+    }
+
+    void retire(typename std::vector<Script>::iterator script) {
+        m_runner.abort(*script->m_context);
+        m_retired.push_back(std::move(script->m_context));
+        m_scripts.erase(script);
+    }
+
+    void handleInotify() {
+        alignas(struct inotify_event) char buffer[4096];
+        ssize_t size;
+
+        while ((size = read(m_inotify, buffer, sizeof(buffer))) > 0) {
+            for (char* p = buffer; p < buffer + size;) {
+                const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW) {
+                    load();
+                } else if (event->len > 0 && (event->mask & (IN_DELETE | IN_MOVED_FROM))) {
+                    unload(event->name);
+                } else if (event->len > 0) {
+                    load(event->name);
+                }
+            }
+        }
+    }
+
+public:
+    DirectoryRunner(const std::vector<Command<ContextType>*>& p_commands, const char* p_directory) :
+        m_runner(p_commands),
+        m_directory(p_directory),
+        m_epoll(epoll_create1(EPOLL_CLOEXEC)),
+        m_timer(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+        m_inotify(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+        m_watch(-1),
+        m_wakeup(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+        m_stop(false) {
+        if (m_inotify >= 0) {
+            m_watch = inotify_add_watch(m_inotify, p_directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM);
+        }
+
+        if (valid()) {
+            watch(m_timer, TIMER_EVENT);
+            watch(m_inotify, INOTIFY_EVENT);
+            watch(m_wakeup, WAKEUP_EVENT);
+        }
+    }
+
+    DirectoryRunner(const DirectoryRunner&) = delete;
+    DirectoryRunner& operator=(const DirectoryRunner&) = delete;
+
+    ~DirectoryRunner() {
+        for (int fd : {
+                    m_wakeup, m_inotify, m_timer, m_epoll
+                }) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    /**
+     * False when the file descriptors for the loop could not be created or the directory can't be watched
+     */
+    bool valid() const {
+        return m_epoll >= 0 && m_timer >= 0 && m_inotify >= 0 && m_watch >= 0 && m_wakeup >= 0;
+    }
+
+    ScriptRunner<ContextType>& runner() {
+        return m_runner;
+    }
+
+    /**
+     * Called for every context that is loaded, before it is started, for example to set it's priority or timer slack
+     */
+    void onLoaded(const TLoadedFunction& p_loaded) {
+        m_loaded = p_loaded;
+    }
+
+    /**
+     * (Re)load all scripts in the directory and drop the ones whose file is gone, returns the number of scripts
+     */
+    size_t load() {
+        DIR* dir = opendir(m_directory.c_str());
+
+        if (dir == nullptr) {
+            return m_scripts.size();
+        }
+
+        std::vector<std::string> names;
+        struct dirent* entry;
+
+        while ((entry = readdir(dir)) != nullptr) {
+            if (!skip(entry->d_name)) {
+                names.push_back(entry->d_name);
+            }
+        }
+
+        closedir(dir);
+
+        for (size_t i = m_scripts.size(); i-- > 0;) {
+            bool found = false;
+
+            for (auto& name : names) {
+                found |= name == m_scripts[i].m_name;
+            }
+
+            if (!found) {
+                retire(m_scripts.begin() + i);
+            }
+        }
+
+        for (auto& name : names) {
+            load(name.c_str());
+        }
+
+        return m_scripts.size();
+    }
+
+    /**
+     * Load the script name from the directory and start it, a script that was loaded before is replaced.
+     * Returns false when the file can't be read
+     */
+    bool load(const char* name) {
+        if (skip(name)) {
+            return false;
+        }
+
+        std::string text;
+
+        if (!readFile(m_directory + "/" + name, text)) {
+            unload(name);
+            return false;
+        }
+
+        auto existing = find(name);
+
+        if (existing != m_scripts.end()) {
+            retire(existing);
+        }
+
+        Script script;
+        script.m_name = name;
+        script.m_context.reset(new ContextType(text.c_str()));
+
+        if (m_loaded) {
+            m_loaded(name, *script.m_context);
+        }
+
+        m_runner.start(*script.m_context);
+        m_scripts.push_back(std::move(script));
+        return true;
+    }
+
+    /**
+     * Abort and forget the script name
+     */
+    void unload(const char* name) {
+        auto existing = find(name);
+
+        if (existing != m_scripts.end()) {
+            retire(existing);
+        }
+    }
+
+    /**
+     * Context of the script name, nullptr when it's not loaded
+     */
+    ContextType* context(const char* name) {
+        auto existing = find(name);
+        return existing == m_scripts.end() ? nullptr : existing->m_context.get();
+    }
+
+    size_t size() const {
+        return m_scripts.size();
+    }
+
+    /**
+     * Handle the runner once and wait until there is work again, or at most timeout milli seconds (-1 is no limit).
+     * Returns false once stop() was called
+     */
+    bool runOnce(int timeout = -1) {
+        m_runner.handle();
+        m_retired.clear();
+
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        uint32_t wakeAt;
+
+        if (m_runner.nextWakeup(wakeAt)) {
+            int32_t delay = static_cast<int32_t>(wakeAt - millis());
+
+            if (delay <= 0) {
+                timeout = 0;
+            } else {
+                spec.it_value.tv_sec = delay / 1000;
+                spec.it_value.tv_nsec = (delay % 1000) * 1000000L;
+            }
+        }
+
+        // A zero it_value disarms the timer
+        timerfd_settime(m_timer, 0, &spec, nullptr);
+
+        struct epoll_event events[3];
+        int count = m_stop ? 0 : epoll_wait(m_epoll, events, 3, timeout);
+
+        for (int i = 0; i < count; i++) {
+            switch (events[i].data.u64) {
+                case INOTIFY_EVENT:
+                    handleInotify();
+                    break;
+
+                default:
+                    drain(events[i].data.u64 == TIMER_EVENT ? m_timer : m_wakeup);
+            }
+        }
+
+        return !m_stop;
+    }
+
+    /**
+     * Load the directory and keep running until stop() is called
+     */
+    void run() {
+        load();
+
+        while (runOnce()) {
+        }
+    }
+
+    /**
+     * Make a waiting runOnce() return, call it after posting requests or signals to runner() from another thread.
+     * Only does a write(), so it can be called from a signal handler
+     */
+    void wake() {
+        uint64_t one = 1;
+        ssize_t written = write(m_wakeup, &one, sizeof(one));
+        (void)written;
+    }
+
+    void stop() {
+        m_stop = true;
+        wake();
+    }
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,132 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <new>
+
+namespace rvt {
+
+namespace scriptrunner {
+
+/**
+ * Bump allocator over a caller supplied buffer.
+ * Individual deallocations are ignored, everything is handed back at once with release().
+ * When the buffer is exhausted additional blocks are taken from the heap, these are
+ * freed on release() as well.
+ */
+class MonotonicArena {
+    struct Block {
+        Block* m_next;
+    };
+
+    char* m_buffer;
+    size_t m_size;
+    size_t m_used;
+    Block* m_overflow;
+
+    static size_t alignUp(size_t value, size_t alignment) {
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+
+public:
+    MonotonicArena(void* p_buffer, size_t p_size) :
+        m_buffer(static_cast<char*>(p_buffer)),
+        m_size(p_size),
+        m_used(0),
+        m_overflow(nullptr) {
+    }
+
+    MonotonicArena(const MonotonicArena&) = delete;
+    MonotonicArena& operator=(const MonotonicArena&) = delete;
+
+    ~MonotonicArena() {
+        release();
+    }
+
+    void* allocate(size_t bytes, size_t alignment) {
+        size_t start = alignUp(reinterpret_cast<uintptr_t>(m_buffer) + m_used, alignment) -
+                       reinterpret_cast<uintptr_t>(m_buffer);
+
+        if (start + bytes <= m_size) {
+            m_used = start + bytes;
+            return m_buffer + start;
+        }
+
+        size_t header = alignUp(sizeof(Block), alignment);
+        Block* block = static_cast<Block*>(malloc(header + bytes));
+
+        if (block == nullptr) {
+            return nullptr;
+        }
+
+        block->m_next = m_overflow;
+        m_overflow = block;
+        return reinterpret_cast<char*>(block) + header;
+    }
+
+    /**
+     * Release all memory handed out by this arena in one go
+     */
+    void release() {
+        while (m_overflow != nullptr) {
+            Block* next = m_overflow->m_next;
+            free(m_overflow);
+            m_overflow = next;
+        }
+
+        m_used = 0;
+    }
+
+    /**
+     * Bytes used within the supplied buffer
+     */
+    size_t used() const {
+        return m_used;
+    }
+
+    bool overflowed() const {
+        return m_overflow != nullptr;
+    }
+};
+
+/**
+ * Standard allocator that takes it's memory from a MonotonicArena
+ */
+template<typename T>
+class ArenaAllocator {
+    template<typename U> friend class ArenaAllocator;
+    MonotonicArena* m_arena;
+public:
+    typedef T value_type;
+
+    ArenaAllocator(MonotonicArena& p_arena) : m_arena(&p_arena) {
+    }
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& p_other) : m_arena(p_other.m_arena) {
+    }
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(m_arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, size_t) {
+    }
+
+    MonotonicArena& arena() const {
+        return *m_arena;
+    }
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U>& p_other) const {
+        return m_arena == p_other.m_arena;
+    }
+
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U>& p_other) const {
+        return m_arena != p_other.m_arena;
+    }
+};
+
+}
+}
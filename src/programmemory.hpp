@@ -0,0 +1,76 @@
+#pragma once
+/**
+ * Access to read-only memory that holds programs, so programs can stay in flash
+ */
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#define SCRIPTRUNNER_PROGMEM
+#elif defined(ESP8266) || defined(ARDUINO_ARCH_ESP8266)
+#include <pgmspace.h>
+#define SCRIPTRUNNER_PROGMEM
+#endif
+
+/**
+ * Size of the buffers the key and value of a command line are copied into when they can't be read directly.
+ * SCRIPTRUNNER_STATIC_SCRIPT does not compile scripts with longer keys or values
+ */
+#ifndef SCRIPTRUNNER_STRING_BUFFER
+#define SCRIPTRUNNER_STRING_BUFFER 64
+#endif
+
+namespace rvt {
+
+namespace scriptrunner {
+
+/**
+ * Memory that can be read like any other, the default. On the ESP32 and on a host constants are mapped
+ * into the address space so this also reads from flash
+ */
+struct DirectMemory {
+    static void copy(void* destination, const void* source, size_t size) {
+        memcpy(destination, source, size);
+    }
+
+    /**
+     * Readable pointer to the string at source, buffer is used when it had to be copied
+     */
+    static const char* string(const char* source, char* buffer, size_t size) {
+        (void)buffer;
+        (void)size;
+        return source;
+    }
+};
+
+#ifdef SCRIPTRUNNER_PROGMEM
+/**
+ * Data placed with PROGMEM, it's only read through the _P functions.
+ * The ESP8266 can only read flash 32 bits at a time, AVR keeps it in a separate address space
+ */
+struct ProgmemMemory {
+    static void copy(void* destination, const void* source, size_t size) {
+        memcpy_P(destination, source, size);
+    }
+
+    static const char* string(const char* source, char* buffer, size_t size) {
+        strncpy_P(buffer, source, size - 1);
+        buffer[size - 1] = '\0';
+        return buffer;
+    }
+};
+#endif
+
+/**
+ * Copy of the value at source in program memory
+ */
+template<typename Memory, typename T>
+T readMemory(const T* source) {
+    T value;
+    Memory::copy(&value, source, sizeof(T));
+    return value;
+}
+
+}
+}
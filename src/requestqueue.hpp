@@ -0,0 +1,82 @@
+#pragma once
+#include <atomic>
+
+namespace rvt {
+
+namespace scriptrunner {
+
+/**
+ * Link embedded in every context so it can be queued without allocating
+ */
+struct RequestNode {
+    std::atomic<RequestNode*> m_next;
+    void* m_owner;
+
+    RequestNode() : m_next(nullptr), m_owner(nullptr) {
+    }
+};
+
+/**
+ * Intrusive multi producer single consumer queue (D. Vyukov)
+ * push() is wait free, a single atomic exchange, so it can be called from any thread or from an interrupt handler.
+ * pop() must only be called by the single consumer. A node must not be pushed again before it was popped.
+ */
+class RequestQueue {
+    std::atomic<RequestNode*> m_tail;
+    RequestNode* m_head;
+    RequestNode m_stub;
+
+public:
+    RequestQueue() : m_tail(&m_stub), m_head(&m_stub) {
+    }
+
+    RequestQueue(const RequestQueue&) = delete;
+    RequestQueue& operator=(const RequestQueue&) = delete;
+
+    void push(RequestNode* node) {
+        node->m_next.store(nullptr, std::memory_order_relaxed);
+        RequestNode* previous = m_tail.exchange(node, std::memory_order_acq_rel);
+        previous->m_next.store(node, std::memory_order_release);
+    }
+
+    /**
+     * Returns the oldest node, or nullptr when the queue is empty or a producer is half way a push,
+     * in that case the node is returned on a later call
+     */
+    RequestNode* pop() {
+        RequestNode* head = m_head;
+        RequestNode* next = head->m_next.load(std::memory_order_acquire);
+
+        if (head == &m_stub) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+
+            m_head = next;
+            head = next;
+            next = next->m_next.load(std::memory_order_acquire);
+        }
+
+        if (next != nullptr) {
+            m_head = next;
+            return head;
+        }
+
+        if (head != m_tail.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+
+        push(&m_stub);
+        next = head->m_next.load(std::memory_order_acquire);
+
+        if (next != nullptr) {
+            m_head = next;
+            return head;
+        }
+
+        return nullptr;
+    }
+};
+
+}
+}
@@ -0,0 +1,1219 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include <optparser.hpp>
+#include "symboltable.hpp"
+
+/**
+ * Width of the offsets used to store a compiled script. 16 bit offsets keep each line at
+ * a handful of bytes and limit a single script to 64KB of unique text and 64K lines.
+ * Define SCRIPTRUNNER_OFFSET_TYPE as uint32_t for larger scripts, it can't be smaller than a SymbolId
+ */
+#ifndef SCRIPTRUNNER_OFFSET_TYPE
+#define SCRIPTRUNNER_OFFSET_TYPE uint16_t
+#endif
+
+/**
+ * Default for the peephole pass of BasicProgram::optimize(), define as false to run scripts exactly as written
+ */
+#ifndef SCRIPTRUNNER_PEEPHOLE
+#define SCRIPTRUNNER_PEEPHOLE true
+#endif
+
+/**
+ * Number of registers, r0 up to r(SCRIPTRUNNER_REGISTERS - 1), each context has it's own 32 bit registers
+ */
+#ifndef SCRIPTRUNNER_REGISTERS
+#define SCRIPTRUNNER_REGISTERS 8
+#endif
+
+namespace rvt {
+
+namespace scriptrunner {
+
+typedef SCRIPTRUNNER_OFFSET_TYPE ScriptOffset;
+
+// Label, jump and call lines keep a SymbolId in the value of the line
+static_assert(sizeof(ScriptOffset) >= sizeof(SymbolId), "SCRIPTRUNNER_OFFSET_TYPE must hold a SymbolId");
+
+/**
+ * Instructions known by the interpreter, any other key is a command
+ * The values of the built-in's match their SymbolTable id
+ */
+enum class Opcode : uint8_t {
+    COMMAND = SymbolTable::EMPTY,
+    END = SymbolTable::END,
+    JUMP = SymbolTable::JUMP,
+    WAIT = SymbolTable::WAIT,
+    LABEL = SymbolTable::LABEL,
+    REPEAT = SymbolTable::REPEAT,
+    ENDREPEAT = SymbolTable::ENDREPEAT,
+    CALL = SymbolTable::CALL,
+    RETURN = SymbolTable::RETURN,
+    SET = SymbolTable::SET,
+    ADD = SymbolTable::ADD,
+    CMP = SymbolTable::CMP,
+    JEQ = SymbolTable::JEQ,
+    JNE = SymbolTable::JNE,
+    JLT = SymbolTable::JLT,
+    JLE = SymbolTable::JLE,
+    JGT = SymbolTable::JGT,
+    JGE = SymbolTable::JGE,
+    JTRUE = SymbolTable::JTRUE,
+    JFALSE = SymbolTable::JFALSE,
+    SWITCH = SymbolTable::SWITCH,
+    // A jump resolved by optimize(), the value is the line to continue with
+    GOTO = 0x80,
+    // A call resolved by optimize(), the value is the first line of the subroutine
+    GOSUB = 0x81,
+    // A conditional jump resolved by optimize(), the symbol tells the condition and the value is the line to jump to
+    BRANCH = 0x82,
+    // An include, or a call of a label in an included module, the value is the number of it's ScriptFarCall
+    FARCALL = 0x83
+};
+
+/**
+ * A single line of a compiled script
+ * The key is an interned symbol, the value is an offset into the string pool of it's program
+ * except for label, jump, call and conditional jump lines where the value is the interned label name and goto,
+ * gosub and branch lines where it's a line number.
+ * Once optimized the value of repeat and endrepeat lines is the number of their loop, the value of
+ * set, add and cmp lines the number of their operands and the value of switch lines the number of their jump table
+ */
+struct ScriptLine {
+    Opcode m_opcode;
+    SymbolId m_symbol;
+    ScriptOffset m_value;
+};
+
+/**
+ * A label taken out of the lines by optimize(), line is where the label was
+ */
+struct ScriptLabel {
+    SymbolId m_label;
+    ScriptOffset m_line;
+};
+
+/**
+ * A repeat / endrepeat pair resolved by optimize()
+ * body is the first line of the loop, text is the pool offset of the count as written
+ */
+struct ScriptLoop {
+    ScriptOffset m_body;
+    ScriptOffset m_text;
+    uint32_t m_count;
+};
+
+/**
+ * Operands of set, add and cmp, written as r<register>,<number or r<register>>
+ * source is NO_REGISTER when the second operand is the number immediate
+ */
+struct ScriptOperands {
+    enum : uint8_t {
+        NO_REGISTER = 0xff
+    };
+
+    uint8_t m_register;
+    uint8_t m_source;
+    ScriptOffset m_text;
+    int32_t m_immediate;
+};
+
+/**
+ * Jump table of a switch, written as r<register>,<label>,<label>...
+ * The lines to jump to are targets first up to first + count in the target table of the program
+ */
+struct ScriptSwitch {
+    uint8_t m_register;
+    ScriptOffset m_text;
+    ScriptOffset m_first;
+    ScriptOffset m_count;
+};
+
+/**
+ * Line in an included module a far call continues with. module is the number of the module in the including program,
+ * name the module for an include or the label for a call
+ */
+struct ScriptFarCall {
+    SymbolId m_name;
+    ScriptOffset m_module;
+    ScriptOffset m_line;
+};
+
+/**
+ * The program itself or one of the modules it includes, directly or through another module.
+ * program is nullptr for the program itself, loop is the first loop counter of the unit in the context
+ * and modules the unit of the first module it includes
+ */
+template<typename Module>
+struct ScriptUnit {
+    const Module* m_program;
+    ScriptOffset m_loop;
+    ScriptOffset m_modules;
+};
+
+template<typename Allocator>
+class BasicProgram;
+
+/**
+ * Named blocks of script that are parsed once and can be included by any script with include=name.
+ * A module is compiled once and shared by all scripts that include it, it's lines are not copied into them.
+ * An include runs the module like a subroutine and a call of a label of an included module runs
+ * that subroutine of the module, both take a level of SCRIPTRUNNER_CALL_DEPTH. The end of a module returns
+ * to the script. A module can hold labels, loops and subroutines, and can include modules itself.
+ * Modules must be added before the scripts that use them, an include of an unknown module is left to the commands.
+ * Like the SymbolTable it's shared by everything in the process and not synchronised
+ */
+class ModuleTable {
+    struct Module {
+        SymbolId m_name;
+        std::shared_ptr<const BasicProgram<std::allocator<char>>> m_program;
+    };
+
+    std::vector<Module> m_modules;
+
+    ModuleTable() {
+    }
+
+public:
+    ModuleTable(const ModuleTable&) = delete;
+    ModuleTable& operator=(const ModuleTable&) = delete;
+
+    static ModuleTable& instance();
+
+    /**
+     * Parse and optimize script as module name, a module with the same name is replaced.
+     * Scripts that included the old module keep using it
+     */
+    void add(const char* name, const char* script);
+
+    bool remove(const char* name);
+
+    /**
+     * Module with the interned name, nullptr when there is none
+     */
+    std::shared_ptr<const BasicProgram<std::allocator<char>>> find(SymbolId name) const;
+
+    size_t size() const {
+        return m_modules.size();
+    }
+
+    /**
+     * Bytes used by the parsed modules
+     */
+    size_t memoryUsage() const;
+};
+
+/**
+ * Compiled form of a script
+ * Keys are interned in the SymbolTable, values are stored once in a single string pool and lines
+ * refer to them by offset, so a line like wait=50 costs sizeof(ScriptLine) bytes plus it's value when that was not seen before
+ */
+template<typename Allocator = std::allocator<char>>
+class BasicProgram {
+    template<typename OtherAllocator>
+    friend class BasicProgram;
+
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<char> CharAllocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<ScriptLine> LineAllocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<ScriptLabel> LabelAllocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<ScriptOffset> OffsetAllocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<ScriptLoop> LoopAllocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<ScriptOperands> OperandsAllocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<ScriptSwitch> SwitchAllocator;
+    typedef std::shared_ptr<const BasicProgram<std::allocator<char>>> ModulePtr;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<ModulePtr> ModuleAllocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<ScriptFarCall> FarCallAllocator;
+
+public:
+    typedef ScriptUnit<BasicProgram<std::allocator<char>>> Unit;
+
+private:
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<Unit> UnitAllocator;
+    std::vector<ScriptLine, LineAllocator> m_lines;
+    std::vector<char, CharAllocator> m_pool;
+    std::vector<ScriptLabel, LabelAllocator> m_labels;
+    std::vector<ScriptLoop, LoopAllocator> m_loops;
+    std::vector<ScriptOperands, OperandsAllocator> m_operands;
+    std::vector<ScriptSwitch, SwitchAllocator> m_switches;
+    // Lines the switches jump to
+    std::vector<ScriptOffset, OffsetAllocator> m_targets;
+    // Modules included by the script, their lines are run where they are
+    std::vector<ModulePtr, ModuleAllocator> m_modules;
+    std::vector<ScriptFarCall, FarCallAllocator> m_farCalls;
+    // Every module reachable through the includes, empty when there are none
+    std::vector<Unit, UnitAllocator> m_units;
+    size_t m_counters = 0;
+    // Open addressing hash index of the pool while compiling, 0 is a free slot. Built when needed, dropped by optimize()
+    std::vector<ScriptOffset, OffsetAllocator> m_poolIndex;
+    size_t m_poolStrings = 0;
+    // Lines before this one went through optimize() already
+    size_t m_optimizedLines = 0;
+    // Cleared when the script did not fit in ScriptOffset or the SymbolTable is full
+    bool m_valid = true;
+
+    static bool fits(size_t value) {
+        return value <= std::numeric_limits<ScriptOffset>::max();
+    }
+
+    void push(const ScriptLine& line) {
+        if (fits(m_lines.size())) {
+            m_lines.push_back(line);
+        } else {
+            m_valid = false;
+        }
+    }
+
+    /**
+     * Drop everything but an end line, so a script that could not be loaded ends right away
+     */
+    void discard() {
+        m_lines.assign(1, ScriptLine{Opcode::END, SymbolTable::END, 0});
+        m_pool.assign(1, '\0');
+        m_labels.clear();
+        m_loops.clear();
+        m_operands.clear();
+        m_switches.clear();
+        m_targets.clear();
+        m_modules.clear();
+        m_farCalls.clear();
+        m_units.clear();
+        m_counters = 0;
+        m_optimizedLines = 1;
+        dropPoolIndex();
+    }
+
+    /**
+     * Rebuild the pool index big enough to add a string, at most half of the slots are used
+     */
+    void indexPool() {
+        size_t strings = 0;
+
+        for (size_t offset = 1; offset < m_pool.size(); offset += strlen(&m_pool[offset]) + 1) {
+            strings++;
+        }
+
+        size_t slots = 16;
+
+        while (slots < (strings + 1) * 2) {
+            slots *= 2;
+        }
+
+        m_poolIndex.assign(slots, 0);
+        m_poolStrings = strings;
+
+        for (size_t offset = 1; offset < m_pool.size(); offset += strlen(&m_pool[offset]) + 1) {
+            const char* str = &m_pool[offset];
+            size_t slot = SymbolTable::hash(str, strlen(str)) & (slots - 1);
+
+            while (m_poolIndex[slot] != 0) {
+                slot = (slot + 1) & (slots - 1);
+            }
+
+            m_poolIndex[slot] = offset;
+        }
+    }
+
+    void dropPoolIndex() {
+        m_poolIndex.clear();
+        m_poolIndex.shrink_to_fit();
+        m_poolStrings = 0;
+    }
+
+    const ScriptLabel* findLabel(SymbolId label) const {
+        for (auto& entry : m_labels) {
+            if (entry.m_label == label) {
+                return &entry;
+            }
+        }
+
+        return nullptr;
+    }
+
+    static bool number(const char* text, uint32_t& value) {
+        value = 0;
+
+        if (*text == '\0') {
+            return false;
+        }
+
+        for (; *text; text++) {
+            if (*text < '0' || *text > '9') {
+                return false;
+            }
+
+            value = value * 10 + (*text - '0');
+        }
+
+        return true;
+    }
+
+    static bool integer(const char* text, int32_t& value) {
+        bool negative = *text == '-';
+        uint32_t magnitude;
+
+        if (negative || *text == '+') {
+            text++;
+        }
+
+        if (!number(text, magnitude)) {
+            return false;
+        }
+
+        value = negative ? -static_cast<int32_t>(magnitude) : static_cast<int32_t>(magnitude);
+        return true;
+    }
+
+    static bool registerIndex(const char*& text, uint8_t& index) {
+        uint32_t value = 0;
+
+        if (text[0] != 'r' || text[1] < '0' || text[1] > '9') {
+            return false;
+        }
+
+        for (text++; *text >= '0' && *text <= '9'; text++) {
+            value = value * 10 + (*text - '0');
+
+            if (value >= SCRIPTRUNNER_REGISTERS) {
+                return false;
+            }
+        }
+
+        index = value;
+        return true;
+    }
+
+    static bool parseOperands(const char* text, ScriptOperands& operands) {
+        if (!registerIndex(text, operands.m_register) || *text++ != ',') {
+            return false;
+        }
+
+        const char* source = text;
+        operands.m_immediate = 0;
+
+        if (registerIndex(source, operands.m_source) && *source == '\0') {
+            return true;
+        }
+
+        operands.m_source = ScriptOperands::NO_REGISTER;
+        return integer(text, operands.m_immediate);
+    }
+
+    static bool isConditionalJump(Opcode opcode) {
+        return opcode >= Opcode::JEQ && opcode <= Opcode::JFALSE;
+    }
+
+    static bool isResolvedJump(Opcode opcode) {
+        return opcode == Opcode::GOTO || opcode == Opcode::GOSUB || opcode == Opcode::BRANCH;
+    }
+
+    /**
+     * Parse the operands of set, add and cmp. A line that does not parse is left to the commands,
+     * so existing commands with these names keep working
+     */
+    void linkOperands(size_t first) {
+        for (size_t i = first; i < m_lines.size(); i++) {
+            ScriptLine& line = m_lines[i];
+
+            if (line.m_opcode != Opcode::SET && line.m_opcode != Opcode::ADD && line.m_opcode != Opcode::CMP) {
+                continue;
+            }
+
+            ScriptOperands operands;
+            operands.m_text = line.m_value;
+
+            if (parseOperands(string(line.m_value), operands)) {
+                m_operands.push_back(operands);
+                line.m_value = m_operands.size() - 1;
+            } else {
+                line.m_opcode = Opcode::COMMAND;
+            }
+        }
+    }
+
+    /**
+     * Build the jump table of every switch, lines from first on are new. A switch with a register that does not parse
+     * or a label that does not exist is left to the commands like a conditional jump
+     */
+    void linkSwitches(size_t first) {
+        SymbolTable& symbols = SymbolTable::instance();
+
+        for (size_t i = first; i < m_lines.size(); i++) {
+            ScriptLine& line = m_lines[i];
+
+            if (line.m_opcode != Opcode::SWITCH) {
+                continue;
+            }
+
+            const char* text = string(line.m_value);
+            ScriptSwitch table{0, line.m_value, static_cast<ScriptOffset>(m_targets.size()), 0};
+            bool valid = registerIndex(text, table.m_register) && *text == ',';
+
+            while (valid && *text == ',') {
+                const char* name = ++text;
+                text += strcspn(text, ",");
+                // Label names are interned already, so this does not add new symbols
+                SymbolId label = symbols.find(name, text - name);
+                size_t target;
+                valid = label != SymbolTable::NOT_FOUND && jumpTarget(label, target);
+
+                if (valid && !fits(m_targets.size())) {
+                    m_valid = valid = false;
+                }
+
+                if (valid) {
+                    m_targets.push_back(target);
+                    table.m_count++;
+                }
+            }
+
+            if (valid) {
+                m_switches.push_back(table);
+                line.m_value = m_switches.size() - 1;
+            } else {
+                m_targets.resize(table.m_first);
+                line.m_opcode = Opcode::COMMAND;
+            }
+        }
+    }
+
+    /**
+     * Mark the lines that can be reached other than from the line before them
+     */
+    void markEntries(ScriptOffset* marks) const {
+        memset(marks, 0, m_lines.size() * sizeof(ScriptOffset));
+
+        for (auto& entry : m_labels) {
+            marks[entry.m_line] = 1;
+        }
+
+        for (auto& loop : m_loops) {
+            // The body of a loop that runs 0 times can only be reached through a label
+            marks[loop.m_body] |= loop.m_count != 0;
+        }
+
+        for (auto& line : m_lines) {
+            if (isResolvedJump(line.m_opcode)) {
+                marks[line.m_value] = 1;
+            }
+        }
+
+        for (auto target : m_targets) {
+            marks[target] = 1;
+        }
+    }
+
+    /**
+     * Remove the lines that are not marked to keep, keep[] is overwritten with the new number of every line
+     * so jumps and labels to a removed line go to the line that followed it
+     */
+    void compact(ScriptOffset* keep) {
+        size_t size = m_lines.size();
+        size_t kept = 0;
+
+        for (size_t i = 0; i < size; i++) {
+            bool keepLine = keep[i] != 0;
+            keep[i] = kept;
+
+            if (keepLine) {
+                m_lines[kept++] = m_lines[i];
+            }
+        }
+
+        m_lines.resize(kept);
+
+        for (auto& line : m_lines) {
+            if (isResolvedJump(line.m_opcode)) {
+                line.m_value = keep[line.m_value];
+            }
+        }
+
+        for (auto& entry : m_labels) {
+            entry.m_line = keep[entry.m_line];
+        }
+
+        for (auto& loop : m_loops) {
+            loop.m_body = keep[loop.m_body];
+        }
+
+        for (auto& target : m_targets) {
+            target = keep[target];
+        }
+    }
+
+    /**
+     * Give every repeat / endrepeat pair it's own loop, the endrepeat jumps back to the line after the repeat.
+     * A loop that runs 0 times becomes a jump past it's endrepeat, an endrepeat without repeat is dropped.
+     * Runs before the labels are removed, lines from first on are new
+     */
+    void linkLoops(size_t first, ScriptOffset* open) {
+        size_t depth = 0;
+
+        for (size_t i = first; i < m_lines.size(); i++) {
+            ScriptLine& line = m_lines[i];
+
+            if (line.m_opcode == Opcode::REPEAT) {
+                uint32_t count;
+
+                if (!number(string(line.m_value), count)) {
+                    count = 0;
+                }
+
+                m_loops.push_back(ScriptLoop{static_cast<ScriptOffset>(i + 1), line.m_value, count});
+                line.m_value = m_loops.size() - 1;
+                open[depth++] = i;
+            } else if (line.m_opcode == Opcode::ENDREPEAT) {
+                if (depth == 0) {
+                    // Removed together with the labels
+                    line.m_opcode = Opcode::LABEL;
+                    line.m_value = SymbolTable::EMPTY;
+                    continue;
+                }
+
+                ScriptLine& repeat = m_lines[open[--depth]];
+                line.m_value = repeat.m_value;
+
+                if (m_loops[repeat.m_value].m_count == 0) {
+                    repeat.m_opcode = Opcode::GOTO;
+                    repeat.m_value = i + 1;
+                }
+            }
+        }
+    }
+
+    /**
+     * Turn the entry marks into keep marks, lines that do nothing are not kept.
+     * Waits are only merged into the wait before them when they are not an entry
+     */
+    void peephole(ScriptOffset* keep) {
+        size_t size = m_lines.size();
+
+        for (size_t i = 0; i < size; i++) {
+            ScriptLine& line = m_lines[i];
+            uint32_t total;
+            keep[i] = 1;
+
+            if ((line.m_opcode == Opcode::GOTO || line.m_opcode == Opcode::BRANCH) && line.m_value == i + 1) {
+                keep[i] = 0;
+            } else if (line.m_opcode == Opcode::WAIT && number(string(line.m_value), total)) {
+                size_t last = i;
+                uint32_t next;
+
+                while (last + 1 < size && keep[last + 1] == 0 && m_lines[last + 1].m_opcode == Opcode::WAIT &&
+                       number(string(m_lines[last + 1].m_value), next)) {
+                    total += next;
+                    last++;
+                }
+
+                if (total == 0) {
+                    keep[i] = 0;
+                } else if (last != i) {
+                    char text[11];
+                    snprintf(text, sizeof(text), "%lu", static_cast<unsigned long>(total));
+                    line.m_value = intern(text);
+                }
+
+                // keep[] of the merged waits is 0 already, they where not an entry
+                i = last;
+            }
+        }
+    }
+
+    /**
+     * Line a jump to label ends up on, following chains of jumps. Returns false when the label does not exist
+     */
+    bool jumpTarget(SymbolId label, size_t& target) const {
+        const ScriptLabel* entry = findLabel(label);
+
+        if (entry == nullptr) {
+            return false;
+        }
+
+        target = entry->m_line;
+
+        // Bounded, so jumps that go round in circles stay as they are
+        for (size_t hops = 0; hops < m_lines.size(); hops++) {
+            const ScriptLine& line = m_lines[target];
+
+            if (line.m_opcode == Opcode::LABEL) {
+                target++;
+            } else if (line.m_opcode == Opcode::GOTO) {
+                target = line.m_value;
+            } else if (line.m_opcode == Opcode::JUMP && findLabel(line.m_value) != nullptr) {
+                target = findLabel(line.m_value)->m_line;
+            } else {
+                break;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Add a far call to line of module, returns it's number in line
+     */
+    bool farCall(SymbolId name, size_t module, size_t& line) {
+        if (!fits(m_farCalls.size())) {
+            m_valid = false;
+            return false;
+        }
+
+        m_farCalls.push_back(ScriptFarCall{name, static_cast<ScriptOffset>(module), static_cast<ScriptOffset>(line)});
+        line = m_farCalls.size() - 1;
+        return true;
+    }
+
+    /**
+     * Far call to label in the first included module that has it
+     */
+    bool moduleTarget(SymbolId label, size_t& target) {
+        for (size_t i = 0; i < m_modules.size(); i++) {
+            if (m_modules[i]->label(label, target)) {
+                return farCall(label, i, target);
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Number the modules below unit, the modules of a unit follow each other so a far call finds it's unit
+     * from the unit it's made in
+     */
+    template<typename ProgramType>
+    void addUnits(size_t unit, const ProgramType& program) {
+        size_t first = m_units.size();
+        m_units[unit].m_modules = first;
+
+        for (auto& module : program.m_modules) {
+            if (!fits(m_units.size()) || !fits(m_counters + module->loops())) {
+                m_valid = false;
+                return;
+            }
+
+            m_units.push_back(Unit{module.get(), static_cast<ScriptOffset>(m_counters), 0});
+            m_counters += module->loops();
+        }
+
+        for (size_t i = 0; i < program.m_modules.size() && m_valid; i++) {
+            addUnits(first + i, *program.m_modules[i]);
+        }
+    }
+
+    void linkUnits() {
+        m_units.clear();
+        m_counters = m_loops.size();
+
+        if (!m_modules.empty()) {
+            m_units.push_back(Unit{nullptr, 0, 0});
+            addUnits(0, *this);
+        }
+    }
+
+public:
+    BasicProgram(const Allocator& p_allocator = Allocator()) :
+        m_lines(LineAllocator(p_allocator)),
+        m_pool(CharAllocator(p_allocator)),
+        m_labels(LabelAllocator(p_allocator)),
+        m_loops(LoopAllocator(p_allocator)),
+        m_operands(OperandsAllocator(p_allocator)),
+        m_switches(SwitchAllocator(p_allocator)),
+        m_targets(OffsetAllocator(p_allocator)),
+        m_modules(ModuleAllocator(p_allocator)),
+        m_farCalls(FarCallAllocator(p_allocator)),
+        m_units(UnitAllocator(p_allocator)),
+        m_poolIndex(OffsetAllocator(p_allocator)) {
+        // Offset 0 is always the empty string
+        m_pool.push_back('\0');
+    }
+
+    BasicProgram(const char* script, const Allocator& p_allocator = Allocator()) :
+        BasicProgram(p_allocator) {
+        compile(script);
+    }
+
+    static Opcode opcodeFor(SymbolId symbol) {
+        if (symbol >= SymbolTable::END && symbol <= SymbolTable::LAST_INSTRUCTION) {
+            return static_cast<Opcode>(symbol);
+        }
+
+        return Opcode::COMMAND;
+    }
+
+    static bool hasSymbolValue(Opcode opcode) {
+        return opcode == Opcode::LABEL || opcode == Opcode::JUMP || opcode == Opcode::CALL || isConditionalJump(opcode);
+    }
+
+    /**
+     * Parse script and append it's lines followed by an end line
+     */
+    void compile(const char* script) {
+        size_t textSize = strlen(script) + 1;
+        size_t lines = 2;
+
+        for (const char* c = script; *c; c++) {
+            lines += *c == ';';
+        }
+
+        m_lines.reserve(m_lines.size() + lines);
+        m_pool.reserve(m_pool.size() + textSize);
+
+        // OptParser splits in place so it needs a scratch copy, we only keep what was interned
+        CharAllocator allocator(m_pool.get_allocator());
+        char* text = allocator.allocate(textSize);
+        memcpy(text, script, textSize);
+        OptParser::get(text, ';', [this](const OptValue & f) {
+            append(f.key(), (const char*)f);
+        });
+        allocator.deallocate(text, textSize);
+
+        append("end", "");
+        m_lines.shrink_to_fit();
+        m_pool.shrink_to_fit();
+    }
+
+    void append(const char* key, const char* value) {
+        SymbolTable& symbols = SymbolTable::instance();
+        SymbolId symbol = symbols.intern(key);
+
+        if (symbol == SymbolTable::NOT_FOUND) {
+            m_valid = false;
+            return;
+        }
+
+        if (symbol == SymbolTable::INCLUDE) {
+            SymbolId name = symbols.find(value);
+            ModulePtr module = ModuleTable::instance().find(name);
+
+            if (module != nullptr) {
+                include(name, module);
+                return;
+            }
+        }
+
+        Opcode opcode = opcodeFor(symbol);
+        ScriptOffset valueOffset = hasSymbolValue(opcode) ? symbols.intern(value) : intern(value);
+
+        if (hasSymbolValue(opcode) && valueOffset == SymbolTable::NOT_FOUND) {
+            m_valid = false;
+            return;
+        }
+
+        push(ScriptLine{opcode, symbol, valueOffset});
+    }
+
+    /**
+     * Append a line that runs the optimized module name from it's first line, the module is shared and not copied
+     */
+    void include(SymbolId name, const ModulePtr& module) {
+        size_t index = 0;
+
+        while (index < m_modules.size() && m_modules[index] != module) {
+            index++;
+        }
+
+        if (index == m_modules.size()) {
+            m_modules.push_back(module);
+        }
+
+        size_t line = 0;
+        m_valid &= module->valid();
+
+        if (farCall(name, index, line)) {
+            push(ScriptLine{Opcode::FARCALL, SymbolTable::INCLUDE, static_cast<ScriptOffset>(line)});
+        }
+    }
+
+    /**
+     * Rewrite the lines for execution, run once all lines are appended. Labels move to a label table, jumps and calls
+     * are resolved to the line they end up on after following chains of jumps (a jump to an end becomes that end)
+     * and lines that can't be reached are removed. Every label is kept as an entry point since commands can jump
+     * to any of them by name. The program always finishes with an end line.
+     * This may be called again after more lines where appended.
+     * With peephole adjacent waits are merged and lines that do nothing (wait=0, a jump to the next line) are removed,
+     * turn it off to see the lines as written while debugging
+     */
+    void optimize(bool p_peephole = SCRIPTRUNNER_PEEPHOLE) {
+        if (!m_valid) {
+            discard();
+            return;
+        }
+
+        if (m_lines.empty() || m_lines.back().m_opcode != Opcode::END) {
+            append("end", "");
+        }
+
+        size_t size = m_lines.size();
+
+        for (size_t i = 0; i < size; i++) {
+            if (m_lines[i].m_opcode == Opcode::LABEL && findLabel(m_lines[i].m_value) == nullptr) {
+                m_labels.push_back(ScriptLabel{m_lines[i].m_value, static_cast<ScriptOffset>(i)});
+            }
+        }
+
+        for (auto& line : m_lines) {
+            size_t target;
+
+            if (line.m_opcode == Opcode::CALL && jumpTarget(line.m_value, target)) {
+                line.m_opcode = Opcode::GOSUB;
+                line.m_value = target;
+            } else if (line.m_opcode == Opcode::CALL && moduleTarget(line.m_value, target)) {
+                line.m_opcode = Opcode::FARCALL;
+                line.m_value = target;
+            } else if (isConditionalJump(line.m_opcode)) {
+                if (jumpTarget(line.m_value, target)) {
+                    line.m_opcode = Opcode::BRANCH;
+                    line.m_value = target;
+                } else {
+                    // Unknown label, left to the commands
+                    line.m_opcode = Opcode::COMMAND;
+                    line.m_value = intern(SymbolTable::instance().name(line.m_value));
+                }
+            } else if (line.m_opcode == Opcode::JUMP && jumpTarget(line.m_value, target)) {
+                if (m_lines[target].m_opcode == Opcode::END) {
+                    line = m_lines[target];
+                } else {
+                    line.m_opcode = Opcode::GOTO;
+                    line.m_value = target;
+                }
+            }
+        }
+
+        linkSwitches(m_optimizedLines);
+
+        // Scratch table, used as stack for nested loops and to mark entry points and lines to keep
+        // before it's used to renumber the lines
+        OffsetAllocator allocator(m_lines.get_allocator());
+        ScriptOffset* remap = allocator.allocate(size);
+        linkLoops(m_optimizedLines, remap);
+        linkOperands(m_optimizedLines);
+        markEntries(remap);
+        bool reachable = true;
+
+        for (size_t i = 0; i < size; i++) {
+            Opcode opcode = m_lines[i].m_opcode;
+            reachable |= remap[i] != 0;
+            bool keep = (reachable && opcode != Opcode::LABEL) || i == size - 1;
+            remap[i] = keep;
+
+            if (keep && (opcode == Opcode::END || opcode == Opcode::GOTO || opcode == Opcode::JUMP ||
+                         opcode == Opcode::RETURN)) {
+                reachable = false;
+            }
+        }
+
+        compact(remap);
+
+        if (p_peephole) {
+            markEntries(remap);
+            peephole(remap);
+            compact(remap);
+        }
+
+        allocator.deallocate(remap, size);
+        m_optimizedLines = m_lines.size();
+        linkUnits();
+
+        if (!m_valid) {
+            // The pool ran full while merging waits
+            discard();
+        }
+
+        m_lines.shrink_to_fit();
+        m_labels.shrink_to_fit();
+        m_loops.shrink_to_fit();
+        m_operands.shrink_to_fit();
+        m_switches.shrink_to_fit();
+        m_targets.shrink_to_fit();
+        m_farCalls.shrink_to_fit();
+        m_units.shrink_to_fit();
+        m_pool.shrink_to_fit();
+        dropPoolIndex();
+    }
+
+    /**
+     * Line to continue with when jumping to label, false when there is no such label
+     */
+    bool label(SymbolId label, size_t& line) const {
+        const ScriptLabel* entry = findLabel(label);
+
+        if (entry != nullptr) {
+            line = entry->m_line;
+            return true;
+        }
+
+        // Not optimized, labels are still lines
+        for (line = 0; line < m_lines.size(); line++) {
+            if (m_lines[line].m_opcode == Opcode::LABEL && m_lines[line].m_value == label) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Return the pool offset of str, adding it to the pool when not yet present
+     */
+    ScriptOffset intern(const char* str) {
+        size_t length = strlen(str);
+
+        if (length == 0) {
+            return 0;
+        }
+
+        if ((m_poolStrings + 1) * 2 > m_poolIndex.size()) {
+            indexPool();
+        }
+
+        size_t mask = m_poolIndex.size() - 1;
+        size_t slot = SymbolTable::hash(str, length) & mask;
+
+        for (; m_poolIndex[slot] != 0; slot = (slot + 1) & mask) {
+            const char* candidate = &m_pool[m_poolIndex[slot]];
+
+            if (strncmp(candidate, str, length) == 0 && candidate[length] == '\0') {
+                return m_poolIndex[slot];
+            }
+        }
+
+        size_t offset = m_pool.size();
+
+        if (!fits(offset)) {
+            m_valid = false;
+            return 0;
+        }
+
+        m_pool.insert(m_pool.end(), str, str + length + 1);
+        m_poolIndex[slot] = offset;
+        m_poolStrings++;
+        return offset;
+    }
+
+    /**
+     * False when the script did not fit, it's longer than ScriptOffset can address or has more names than
+     * the SymbolTable can hold. Once optimized such a program is a single end line
+     */
+    bool valid() const {
+        return m_valid;
+    }
+
+    /**
+     * Intern the values of the lines with key, for commands that take a name like the event to wait for.
+     * Run at load time, so the names can be looked up without allocating while the script runs
+     */
+    void internValues(const char* key) const {
+        SymbolTable& symbols = SymbolTable::instance();
+        SymbolId symbol = symbols.find(key);
+
+        for (auto& line : m_lines) {
+            if (symbol != SymbolTable::NOT_FOUND && line.m_symbol == symbol) {
+                symbols.intern(value(line));
+            }
+        }
+
+        for (auto& module : m_modules) {
+            module->internValues(key);
+        }
+    }
+
+    Allocator get_allocator() const {
+        return Allocator(m_pool.get_allocator());
+    }
+
+    const ScriptLine& line(size_t index) const {
+        return m_lines[index];
+    }
+
+    const char* string(ScriptOffset offset) const {
+        return m_pool.data() + offset;
+    }
+
+    const char* key(const ScriptLine& line) const {
+        return SymbolTable::instance().name(line.m_symbol);
+    }
+
+    const char* value(const ScriptLine& line) const {
+        if (hasSymbolValue(line.m_opcode)) {
+            return SymbolTable::instance().name(line.m_value);
+        }
+
+        if (line.m_opcode == Opcode::REPEAT) {
+            return string(m_loops[line.m_value].m_text);
+        }
+
+        if (line.m_opcode == Opcode::ENDREPEAT) {
+            return "";
+        }
+
+        if (line.m_opcode == Opcode::SET || line.m_opcode == Opcode::ADD || line.m_opcode == Opcode::CMP) {
+            return string(m_operands[line.m_value].m_text);
+        }
+
+        if (line.m_opcode == Opcode::SWITCH) {
+            return string(m_switches[line.m_value].m_text);
+        }
+
+        if (line.m_opcode == Opcode::FARCALL) {
+            return SymbolTable::instance().name(m_farCalls[line.m_value].m_name);
+        }
+
+        if (isResolvedJump(line.m_opcode)) {
+            // Any label at the target will do
+            for (auto& entry : m_labels) {
+                if (entry.m_line == line.m_value) {
+                    return SymbolTable::instance().name(entry.m_label);
+                }
+            }
+
+            return "";
+        }
+
+        return string(line.m_value);
+    }
+
+    size_t size() const {
+        return m_lines.size();
+    }
+
+    /**
+     * Loops found by optimize()
+     */
+    size_t loops() const {
+        return m_loops.size();
+    }
+
+    /**
+     * Loop counters a context keeps, one for each loop of the program and of the modules it includes
+     */
+    size_t counters() const {
+        return m_counters;
+    }
+
+    const ScriptLoop& loop(size_t index) const {
+        return m_loops[index];
+    }
+
+    /**
+     * Labels found by optimize()
+     */
+    size_t labels() const {
+        return m_labels.size();
+    }
+
+    const ScriptLabel& labelAt(size_t index) const {
+        return m_labels[index];
+    }
+
+    const ScriptOperands& operands(size_t index) const {
+        return m_operands[index];
+    }
+
+    const ScriptSwitch& jumpTable(size_t index) const {
+        return m_switches[index];
+    }
+
+    /**
+     * Line case index of the switch with jump table index jumps to
+     */
+    ScriptOffset switchTarget(size_t index, size_t caseIndex) const {
+        return m_targets[m_switches[index].m_first + caseIndex];
+    }
+
+    /**
+     * Modules included by the script
+     */
+    size_t modules() const {
+        return m_modules.size();
+    }
+
+    const BasicProgram<std::allocator<char>>& module(size_t index) const {
+        return *m_modules[index];
+    }
+
+    const ScriptFarCall& farCallAt(size_t index) const {
+        return m_farCalls[index];
+    }
+
+    /**
+     * Unit index of the program, 0 is the program itself. Only for a program that includes modules
+     */
+    const Unit& unit(size_t index) const {
+        return m_units[index];
+    }
+
+    /**
+     * Bytes used by the lines, the label table and the string pool. Included modules are shared and not counted
+     */
+    size_t memoryUsage() const {
+        return m_lines.capacity() * sizeof(ScriptLine) + m_labels.capacity() * sizeof(ScriptLabel) +
+               m_loops.capacity() * sizeof(ScriptLoop) + m_operands.capacity() * sizeof(ScriptOperands) +
+               m_switches.capacity() * sizeof(ScriptSwitch) + m_targets.capacity() * sizeof(ScriptOffset) +
+               m_modules.capacity() * sizeof(ModulePtr) + m_farCalls.capacity() * sizeof(ScriptFarCall) +
+               m_units.capacity() * sizeof(Unit) + m_pool.capacity();
+    }
+};
+
+typedef BasicProgram<> Program;
+
+inline ModuleTable& ModuleTable::instance() {
+    static ModuleTable s_table;
+    return s_table;
+}
+
+inline void ModuleTable::add(const char* name, const char* script) {
+    SymbolId symbol = SymbolTable::instance().intern(name);
+    // Parsed before the old module is replaced, so a module can include the module it replaces
+    std::shared_ptr<Program> program = std::make_shared<Program>(script);
+    program->optimize();
+
+    for (auto& module : m_modules) {
+        if (module.m_name == symbol) {
+            module.m_program = std::move(program);
+            return;
+        }
+    }
+
+    m_modules.push_back(Module{symbol, std::move(program)});
+}
+
+inline bool ModuleTable::remove(const char* name) {
+    SymbolId symbol = SymbolTable::instance().find(name);
+
+    for (auto it = m_modules.begin(); it != m_modules.end(); ++it) {
+        if (it->m_name == symbol) {
+            m_modules.erase(it);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+inline std::shared_ptr<const Program> ModuleTable::find(SymbolId name) const {
+    for (auto& module : m_modules) {
+        if (module.m_name == name) {
+            return module.m_program;
+        }
+    }
+
+    return nullptr;
+}
+
+inline size_t ModuleTable::memoryUsage() const {
+    size_t usage = m_modules.capacity() * sizeof(Module);
+
+    for (auto& module : m_modules) {
+        usage += sizeof(Program) + module.m_program->memoryUsage();
+    }
+
+    return usage;
+}
+
+}
+}
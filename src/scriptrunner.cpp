@@ -1,10 +1,11 @@
 #include "scriptrunner.hpp"
 
-#ifndef UNIT_TEST
+#if !defined(UNIT_TEST) && !defined(SCRIPTRUNNER_HOST)
 #include <Arduino.h>
 #else
 #include <iostream>
 extern "C" uint32_t millis();
+extern "C" uint32_t micros();
 #endif
 
 namespace rvt {
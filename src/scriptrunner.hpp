@@ -1,15 +1,29 @@
 #pragma once
 #include <stdint.h>
+#include <algorithm>
+#include <atomic>
 #include <functional>
 #include <vector>
 #include <memory>
+#include <new>
+#include <string.h>
 
 #include <optparser.hpp>
+#include "scriptprogram.hpp"
+#include "requestqueue.hpp"
 
-#ifndef UNIT_TEST
+#if !defined(UNIT_TEST) && !defined(SCRIPTRUNNER_HOST)
 #include <Arduino.h>
 #else
 extern "C" uint32_t millis();
+extern "C" uint32_t micros();
+#endif
+
+/**
+ * Number of nested call's a context can make, every level costs a ScriptOffset in each context
+ */
+#ifndef SCRIPTRUNNER_CALL_DEPTH
+#define SCRIPTRUNNER_CALL_DEPTH 4
 #endif
 
 namespace rvt {
@@ -21,39 +35,364 @@ std::unique_ptr<T> make_unique(Args&& ... args) {
     return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
 }
 
+template<typename ContextType, typename Allocator> class ScriptRunner;
+class CommandResult;
+
+/**
+ * Requests that can be posted to a ScriptRunner for a context
+ */
+enum class RunnerRequest : uint8_t {
+    NONE,
+    START,
+    ABORT,
+    PAUSE,
+    RESUME
+};
+
+/**
+ * State of a context within the ScriptRunner it was started on
+ */
+enum class RunState : uint8_t {
+    STOPPED,
+    RUNNING,
+    PAUSED,
+    // Parked on an event, the runner does not handle it until the event is signalled or the wait timed out
+    WAITING
+};
+
+/**
+ * Order in which a ScriptRunner handles it's started contexts
+ */
+enum class SchedulingPolicy : uint8_t {
+    // In the order they where started
+    ROUND_ROBIN,
+    // Highest priority first
+    PRIORITY,
+    // Earliest deadline first, contexts without deadline go last, ties are decided by priority
+    EARLIEST_DEADLINE
+};
+
+/**
+ * State of a context that waits for an event
+ */
+enum class EventState : uint8_t {
+    NONE,
+    WAITING,
+    SIGNALLED,
+    TIMED_OUT
+};
 
-class Context {
+/**
+ * Context holds a compiled script and the position within that script.
+ * The program is kept out of the context, so contexts that run a script translated to C++ or a StaticProgram
+ * are created without a script and don't carry one.
+ * All memory used by the context is obtained from Allocator, so a context can be placed in an arena or pool
+ */
+template<typename Allocator = std::allocator<char>>
+class BasicContext {
     typedef std::unique_ptr<OptValue> OptValuePtr;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<uint32_t> CounterAllocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<BasicProgram<Allocator>> ProgramAllocator;
     uint32_t m_currentTime;
-    std::vector<OptValuePtr>::iterator m_currentLine;
-    std::vector<OptValuePtr> m_script;
-    char* m_scriptText;
+    // Owned, nullptr for a context created without a script
+    BasicProgram<Allocator>* m_program = nullptr;
+    // Iterations left for every repeat in the program
+    std::vector<uint32_t, CounterAllocator> m_loopCounters;
+    // Lines to return to and the units they are in
+    ScriptOffset m_callStack[SCRIPTRUNNER_CALL_DEPTH];
+    ScriptOffset m_callUnits[SCRIPTRUNNER_CALL_DEPTH];
+    uint8_t m_callDepth = 0;
+    // Unit of the program the context is in, 0 unless it runs the lines of an included module
+    ScriptOffset m_unit = 0;
+    int32_t m_registers[SCRIPTRUNNER_REGISTERS] = {};
+    // Outcome of the last cmp, -1 less, 0 equal, 1 greater
+    int8_t m_compare = 0;
+    // Set by commands, tested by jtrue and jfalse
+    bool m_condition = false;
+    ScriptOffset m_currentLine;
 
     unsigned long m_requestedStart;
+    bool m_waitStarted = false;
+    // Set when a command jumped, the line jumped to runs next instead of the line after it
+    bool m_jumped = false;
+
+    SymbolId m_event = SymbolTable::NOT_FOUND;
+    EventState m_eventState = EventState::NONE;
+    bool m_eventTimedOut = false;
+    uint32_t m_eventStart = 0;
+    uint32_t m_eventTimeout = 0;
+    // Set when the context should not be handled before millis() reaches m_wakeAt
+    bool m_sleeping = false;
+    uint32_t m_wakeAt = 0;
+    // A runner may postpone waking this context up to m_timerSlack milli seconds to batch it with other wake ups
+    uint16_t m_timerSlack = 0;
+    uint8_t m_priority = 0;
+    bool m_hasDeadline = false;
+    uint32_t m_deadline = 0;
+
+    // Bookkeeping of the ScriptRunner this context is started on
+    template<typename, typename> friend class ScriptRunner;
+    // Next context in the list of the runner this context is in (running, parked or timers)
+    BasicContext* m_nextLinked = nullptr;
+    RequestNode m_requestNode;
+    // Requests posted since the last handle(), 4 bits each with the oldest in the lowest bits
+    std::atomic<uint32_t> m_postedRequests{0};
+    std::atomic<bool> m_requestQueued{false};
+    RunState m_runState = RunState::STOPPED;
+
+public:
+    /**
+     * Runs the commands for a script translated to C++, implemented by the runner that handles the context
+     */
+    class CommandDispatcher {
+    public:
+        /**
+         * Run the commands for symbol with line like handle() does, next is the line to continue with when they advance
+         */
+        virtual bool command(BasicContext& context, SymbolId symbol, const OptValue& line, ScriptOffset next) const = 0;
+
+    protected:
+        ~CommandDispatcher() {
+        }
+    };
+
+    /**
+     * One tick of a script translated to C++ by the code generator, it does what handle() would do for the line
+     * the context is on and returns false once the script ended
+     */
+    typedef bool (*TCompiledScript)(BasicContext& context, const CommandDispatcher& commands);
+
+    /**
+     * Line of the label name in a translated script, false when there is no such label.
+     * A function instead of a table so the labels can stay in flash
+     */
+    typedef bool (*TCompiledLabel)(const char* name, ScriptOffset& line);
+
+private:
+    TCompiledScript m_compiled = nullptr;
+    TCompiledLabel m_compiledLabel = nullptr;
+
+    // Labels of translated scripts are not interned, so they are found by name
+    bool jumpToCompiled(const char* labelName) {
+        ScriptOffset line;
+
+        if (m_compiledLabel == nullptr || !m_compiledLabel(labelName, line)) {
+            return false;
+        }
+
+        moveTo(line);
+        m_jumped = true;
+        return true;
+    }
+
+    void moveTo(ScriptOffset p_line) {
+        m_currentLine = p_line;
+    }
+
+    /**
+     * The module the context is in, only when m_unit is not 0
+     */
+    const BasicProgram<std::allocator<char>>& module() const {
+        return *m_program->unit(m_unit).m_program;
+    }
+
+    const ScriptLine& runningLine() const {
+        return m_unit == 0 ? m_program->line(m_currentLine) : module().line(m_currentLine);
+    }
+
+    template<typename... Args>
+    void createProgram(Args&& ... args) {
+        ProgramAllocator allocator(get_allocator());
+        m_program = std::allocator_traits<ProgramAllocator>::allocate(allocator, 1);
+        std::allocator_traits<ProgramAllocator>::construct(allocator, m_program, std::forward<Args>(args)...);
+    }
+
 public:
-    Context(const char* script) : m_requestedStart{0} {
-        m_scriptText = strdup(script);
+    typedef Allocator allocator_type;
+
+    BasicContext(const char* script, const Allocator& p_allocator = Allocator()) :
+        m_loopCounters(CounterAllocator(p_allocator)),
+        m_currentLine(0),
+        m_requestedStart{0} {
+        createProgram(script, p_allocator);
+        m_program->optimize();
+        m_loopCounters.resize(m_program->counters());
+    }
+
+    BasicContext(std::vector<OptValuePtr> p_script, const Allocator& p_allocator = Allocator()) :
+        m_loopCounters(CounterAllocator(p_allocator)),
+        m_currentLine(0),
+        m_requestedStart{0} {
+        createProgram(p_allocator);
+
+        for (auto& line : p_script) {
+            m_program->append(line->key(), (const char*)(*line));
+        }
+
+        m_program->optimize();
+        m_loopCounters.resize(m_program->counters());
+    }
+
+    /**
+     * Context without a script, for setCompiledScript(), runStatic() or a generated script
+     */
+    explicit BasicContext(const Allocator& p_allocator = Allocator()) :
+        m_loopCounters(CounterAllocator(p_allocator)),
+        m_currentLine(0),
+        m_requestedStart{0} {
+    }
+
+    BasicContext(const BasicContext&) = delete;
+    BasicContext& operator=(const BasicContext&) = delete;
+
+    virtual ~BasicContext() {
+        if (m_program != nullptr) {
+            ProgramAllocator allocator(get_allocator());
+            std::allocator_traits<ProgramAllocator>::destroy(allocator, m_program);
+            std::allocator_traits<ProgramAllocator>::deallocate(allocator, m_program, 1);
+        }
+    }
+
+    Allocator get_allocator() const {
+        return Allocator(m_loopCounters.get_allocator());
+    }
 
-        OptParser::get(m_scriptText, ';', [this](OptValue f) {
-            m_script.push_back(make_unique<OptValue>(f));
-        });
-        m_script.push_back(make_unique<OptValue>(m_script.size(), "end", ""));
-        m_currentLine = m_script.begin();
+    /**
+     * False for a context created without a script
+     */
+    bool hasProgram() const {
+        return m_program != nullptr;
     }
 
-    Context(std::vector<OptValuePtr> p_script) : m_scriptText(nullptr)  {
-        m_script = std::move(p_script);
-        m_currentLine = m_script.begin();
+    /**
+     * The program of the script the context was created from, only for contexts that have one
+     */
+    const BasicProgram<Allocator>& program() const {
+        return *m_program;
     }
 
-    virtual ~Context() {
-        if (m_scriptText != nullptr) {
-            delete m_scriptText;
+    /**
+     * The line the context is on as written, built from the compact line on each call.
+     * It stays valid when the context moves, as long as the program is not changed
+     */
+    OptValue currentLine() const {
+        if (m_program == nullptr || m_compiled != nullptr) {
+            // Translated scripts don't have lines
+            return OptValue(m_currentLine, "", "");
         }
+
+        const ScriptLine& line = runningLine();
+        return OptValue(m_currentLine, SymbolTable::instance().name(line.m_symbol),
+                        m_unit == 0 ? m_program->value(line) : module().value(line));
+    }
+
+    RunState runState() const {
+        return m_runState;
+    }
+
+    /**
+     * Interned key of the current line
+     */
+    SymbolId currentSymbol() const {
+        return m_program == nullptr ? static_cast<SymbolId>(SymbolTable::END) : runningLine().m_symbol;
+    }
+
+    /**
+     * Rewind the script to the first line and forget any pending wait, sleep, call or repeat
+     * so the context can be run again without parsing the script again.
+     * Extended contexts should override this to clear their own state
+     */
+    virtual void reset() {
+        moveTo(0);
+        m_unit = 0;
+        m_requestedStart = 0;
+        m_waitStarted = false;
+        m_jumped = false;
+        m_callDepth = 0;
+        std::fill(m_loopCounters.begin(), m_loopCounters.end(), 0);
+        memset(m_registers, 0, sizeof(m_registers));
+        m_compare = 0;
+        m_condition = false;
+        m_event = SymbolTable::NOT_FOUND;
+        m_eventState = EventState::NONE;
+        m_eventTimedOut = false;
+        m_eventStart = 0;
+        m_eventTimeout = 0;
+        m_sleeping = false;
+        m_wakeAt = 0;
+    }
+
+    /**
+     * Do not handle this context before millis() reached wakeAt
+     */
+    void sleepUntil(uint32_t wakeAt) {
+        m_sleeping = true;
+        m_wakeAt = wakeAt;
+    }
+
+    bool sleeping() const {
+        return m_sleeping;
     }
 
-    const OptValue& currentLine() const {
-        return *(*m_currentLine).get();
+    /**
+     * True while waitFor() waits for it's event
+     */
+    bool waitingForEvent() const {
+        return m_eventState == EventState::WAITING;
+    }
+
+    /**
+     * True when the context is sleeping or waits for an event with a timeout, it needs to be handled again at wakeAt()
+     */
+    bool hasTimer() const {
+        return m_sleeping || (m_eventState == EventState::WAITING && m_eventTimeout != 0);
+    }
+
+    uint32_t wakeAt() const {
+        return m_wakeAt;
+    }
+
+    /**
+     * Allow a runner to wake this context up to slack milli seconds after a wait, sleep or event timeout expired,
+     * so the wake ups of many contexts that expire close to each other are handled together. 0 wakes up on time
+     */
+    void setTimerSlack(uint16_t slack) {
+        m_timerSlack = slack;
+    }
+
+    uint16_t timerSlack() const {
+        return m_timerSlack;
+    }
+
+    /**
+     * Priority used by a runner with the PRIORITY or EARLIEST_DEADLINE policy, higher runs first
+     */
+    void setPriority(uint8_t priority) {
+        m_priority = priority;
+    }
+
+    uint8_t priority() const {
+        return m_priority;
+    }
+
+    /**
+     * Time in millis() this context should be handled by, used by a runner with the EARLIEST_DEADLINE policy
+     */
+    void setDeadline(uint32_t deadline) {
+        m_hasDeadline = true;
+        m_deadline = deadline;
+    }
+
+    void clearDeadline() {
+        m_hasDeadline = false;
+    }
+
+    bool hasDeadline() const {
+        return m_hasDeadline;
+    }
+
+    uint32_t deadline() const {
+        return m_deadline;
     }
 
     /**
@@ -61,132 +400,1216 @@ public:
      * return true if the waiting is over, returns false if we should not advance to the next line
      */
     bool wait(unsigned long currentMillis, unsigned long millisToWait) {
-        if (m_requestedStart) {
+        if (m_waitStarted) {
             if (currentMillis - m_requestedStart > millisToWait) {
-                m_requestedStart = 0;
+                m_waitStarted = false;
                 return true;
             }
         } else {
-            m_requestedStart = currentMillis == 0 ? 1 : currentMillis;
+            m_requestedStart = currentMillis;
+            m_waitStarted = true;
         }
 
         return false;
     }
 
-    bool jump(const char* labelName) {
-        std::vector<OptValuePtr>::iterator line = m_script.begin();
+    /**
+     * Wait until event is signalled, or until timeout milli seconds passed when timeout is not 0
+     * return true if the waiting is over, returns false if we should not advance to the next line.
+     * A context started on a ScriptRunner is parked by the runner and not handled again until then.
+     * Waiting for NOT_FOUND ends at once as if it timed out
+     */
+    bool waitFor(SymbolId event, uint32_t timeout = 0) {
+        switch (m_eventState) {
+            case EventState::SIGNALLED:
+            case EventState::TIMED_OUT:
+                m_eventTimedOut = m_eventState == EventState::TIMED_OUT;
+                m_eventState = EventState::NONE;
+                return true;
+
+            case EventState::WAITING:
+                // Only seen when the context is handled directly instead of started on a runner
+                if (m_eventTimeout != 0 && millis() - m_eventStart >= m_eventTimeout) {
+                    m_eventTimedOut = true;
+                    m_eventState = EventState::NONE;
+                    return true;
+                }
+
+                return false;
+
+            default:
+                if (event == SymbolTable::NOT_FOUND) {
+                    // Nothing can signal a name that was never interned, don't park the context for it
+                    m_eventTimedOut = true;
+                    return true;
+                }
+
+                m_event = event;
+                m_eventStart = millis();
+                m_eventTimeout = timeout;
+                m_wakeAt = m_eventStart + timeout;
+                m_eventTimedOut = false;
+                m_eventState = EventState::WAITING;
+                return false;
+        }
+    }
 
-        while (
-            line != m_script.end() &&
-            (strcmp((*line).get()->key(), "label") != 0 ||
-             strcmp((char*)(*(*line).get()), labelName) != 0)) {
-            line++;
-        };
+    /**
+     * Wait for event by name. The name is only looked up so this does not allocate, it must be interned at load time
+     * (SymbolTable::intern() or BasicProgram::internValues()). An unknown name can't be signalled, the wait ends at
+     * once and eventTimedOut() is true
+     */
+    bool waitFor(const char* event, uint32_t timeout = 0) {
+        return waitFor(SymbolTable::instance().find(event), timeout);
+    }
+
+    /**
+     * True when the last waitFor() ended because of it's timeout
+     */
+    bool eventTimedOut() const {
+        return m_eventTimedOut;
+    }
 
-        if (line != m_script.end()) {
-            m_currentLine = line;
+    /**
+     * Tell this context event happend, returns true when it was waiting for it
+     */
+    bool signal(SymbolId event) {
+        if (m_eventState == EventState::WAITING && m_event == event) {
+            m_eventState = EventState::SIGNALLED;
             return true;
         }
 
         return false;
     }
 
+    bool jump(const char* labelName) {
+        if (m_compiled != nullptr) {
+            return jumpToCompiled(labelName);
+        }
+
+        return jumpTo(SymbolTable::instance().find(labelName));
+    }
+
     /**
-     * Advance to the next line
-     * as long as the script is running, we return true
+     * Jump to the label with the interned name label
      */
-    bool advance() {
-        const OptValue& current = currentLine();
+    bool jumpTo(SymbolId label) {
+        size_t line;
 
-        if (strcmp(current.key(), "end") == 0) {
+        if (m_compiled != nullptr) {
+            return label != SymbolTable::NOT_FOUND && jumpToCompiled(SymbolTable::instance().name(label));
+        }
+
+        if (m_program == nullptr || !(m_unit == 0 ? m_program->label(label, line) : module().label(label, line))) {
             return false;
-        } else if (strcmp(current.key(), "jump") == 0) {
-            jump(current);
-        } else if (strcmp(current.key(), "wait") == 0) {
-            if (wait(millis(), (int32_t)current)) {
-                m_currentLine++;
-            }
-        } else {
-            m_currentLine++;
         }
 
+        moveTo(line);
+        m_jumped = true;
         return true;
     }
-};
 
-/**
- * Simpel state that gets run each time the StateMachine reaches this state
- */
-template<typename ContextType>
-class Command {
-    //    friend class ScriptRunner;
-public:
-    typedef std::function<bool (const OptValue&, ContextType& context)> TRunFunction;
+    /**
+     * Registers used by set, add and cmp, commands may read and change them as well
+     */
+    int32_t registerValue(uint8_t index) const {
+        return m_registers[index];
+    }
 
-    TRunFunction m_run;
-    const char* m_command;
+    void setRegister(uint8_t index, int32_t value) {
+        m_registers[index] = value;
+    }
 
-private:
+    /**
+     * Outcome of a command for a following jtrue or jfalse, for example a command that checks a sensor
+     */
+    void setCondition(bool value) {
+        m_condition = value;
+    }
 
-public:
+    /**
+     * True when the last cmp, or setCondition() for jtrue and jfalse, makes the conditional jump with symbol jump
+     */
+    bool condition(SymbolId jump) const {
+        switch (jump) {
+            case SymbolTable::JEQ:
+                return m_compare == 0;
 
-    Command(const char* p_command, const TRunFunction& p_run) :
-        m_command(p_command),
-        m_run(p_run) {
+            case SymbolTable::JNE:
+                return m_compare != 0;
+
+            case SymbolTable::JLT:
+                return m_compare < 0;
+
+            case SymbolTable::JLE:
+                return m_compare <= 0;
+
+            case SymbolTable::JGT:
+                return m_compare > 0;
+
+            case SymbolTable::JGE:
+                return m_compare >= 0;
+
+            case SymbolTable::JTRUE:
+                return m_condition;
+
+            case SymbolTable::JFALSE:
+                return !m_condition;
+
+            default:
+                return false;
+        }
     }
 
-    ~Command() {
+    /**
+     * Number of call's that did not return yet
+     */
+    uint8_t callDepth() const {
+        return m_callDepth;
     }
 
-    bool canExecute(const OptValue& execLine) const {
-        return strcmp(execLine.key(), m_command) == 0;
+    /**
+     * Run script instead of the program, for scripts translated to C++. loops is the number of repeat loops in it
+     * and label finds the lines commands can jump to, nullptr when there are no labels.
+     * Used by the generated code, the context should be created without a script
+     */
+    void setCompiledScript(TCompiledScript script, size_t loops, TCompiledLabel label) {
+        m_compiled = script;
+        m_compiledLabel = label;
+        m_loopCounters.assign(loops, 0);
+        reset();
     }
 
-    virtual bool execute(const OptValue& execLine, ContextType& context) {
-        return m_run(execLine, context);
+    TCompiledScript compiledScript() const {
+        return m_compiled;
     }
 
-};
+    /**
+     * Number of the line the context is on
+     */
+    ScriptOffset lineNumber() const {
+        return m_currentLine;
+    }
 
-/**
- * StateMachine itself that will run through all states
- */
-template<typename ContextType>
-class ScriptRunner {
-private:
-    typedef Command<ContextType>* CommandContextPtr;
-    std::vector<CommandContextPtr> m_commands;
+    /**
+     * The step functions below do what advance() does for each instruction, for the generated code.
+     * They return false when the script ended
+     */
+    bool stepTo(ScriptOffset line) {
+        moveTo(line);
+        return true;
+    }
 
-public:
-    ScriptRunner(std::vector<CommandContextPtr> p_commands) :
-        m_commands(p_commands)  {
+    bool stepWait(uint32_t millisToWait, ScriptOffset next) {
+        if (wait(millis(), millisToWait)) {
+            moveTo(next);
+        } else {
+            sleepUntil(m_requestedStart + millisToWait + 1);
+        }
+
+        return true;
     }
 
-    virtual ~ScriptRunner() {
+    bool stepCall(ScriptOffset target, ScriptOffset next) {
+        if (m_callDepth == SCRIPTRUNNER_CALL_DEPTH) {
+            return false;
+        }
+
+        m_callStack[m_callDepth++] = next;
+        moveTo(target);
+        return true;
+    }
+
+    bool stepReturn() {
+        if (m_callDepth == 0) {
+            return false;
+        }
+
+        moveTo(m_callStack[--m_callDepth]);
+        return true;
+    }
+
+    bool stepCompare(int32_t value, int32_t other, ScriptOffset next) {
+        m_compare = (value > other) - (value < other);
+        moveTo(next);
+        return true;
+    }
+
+    bool stepRepeat(size_t loop, uint32_t count, ScriptOffset next) {
+        m_loopCounters[loop] = count;
+        moveTo(next);
+        return true;
+    }
+
+    bool stepEndRepeat(size_t loop, ScriptOffset body, ScriptOffset next) {
+        if (m_loopCounters[loop] > 1) {
+            m_loopCounters[loop]--;
+            moveTo(body);
+        } else {
+            m_loopCounters[loop] = 0;
+            moveTo(next);
+        }
+
+        return true;
     }
 
     /**
-     * Keep running the script
-     * Run's true as long as the script is still running
+     * Advance to the next line
+     * as long as the script is running, we return true.
+     * A return without call and a call deeper than SCRIPTRUNNER_CALL_DEPTH end the script
      */
-    bool handle(ContextType& context) {
-        const OptValue& currentLineValue = context.currentLine();
-
-        bool advance = false;
-        bool hasRan = false;
+    bool advance() {
+        if (m_program == nullptr) {
+            return false;
+        }
 
-        for (auto value : m_commands) {
-            if (value->canExecute(currentLineValue)) {
-                advance = value->execute(currentLineValue, context);
-                hasRan = true;
-            }
+        if (m_unit == 0) {
+            return advance(*m_program, 0);
         }
 
-        if (advance || !hasRan) {
-            return context.advance();
-        } else {
-            return true;
+        return advance(module(), m_program->unit(m_unit).m_loop);
+    }
+
+private:
+    bool call(ScriptOffset unit, ScriptOffset line) {
+        if (m_callDepth == SCRIPTRUNNER_CALL_DEPTH) {
+            return false;
         }
+
+        m_callUnits[m_callDepth] = m_unit;
+        m_callStack[m_callDepth++] = m_currentLine + 1;
+        m_unit = unit;
+        moveTo(line);
+        return true;
+    }
+
+    /**
+     * Advance within program, the program itself or the module of the unit the context is in.
+     * loops is the first loop counter of program
+     */
+    template<typename ProgramType>
+    bool advance(const ProgramType& program, size_t loops) {
+        const ScriptLine& current = program.line(m_currentLine);
+
+        switch (current.m_opcode) {
+            case Opcode::END:
+                if (m_unit == 0 || m_callDepth == 0) {
+                    return false;
+                }
+
+                // The end of a module returns to the script that included it
+                m_unit = m_callUnits[--m_callDepth];
+                moveTo(m_callStack[m_callDepth]);
+                break;
+
+            case Opcode::GOTO:
+                moveTo(current.m_value);
+                break;
+
+            case Opcode::JUMP:
+                jumpTo(current.m_value);
+                break;
+
+            case Opcode::GOSUB:
+                if (!call(m_unit, current.m_value)) {
+                    return false;
+                }
+
+                break;
+
+            case Opcode::FARCALL: {
+                const ScriptFarCall& far = program.farCallAt(current.m_value);
+
+                if (!call(m_program->unit(m_unit).m_modules + far.m_module, far.m_line)) {
+                    return false;
+                }
+
+                break;
+            }
+
+            case Opcode::RETURN:
+                if (m_callDepth == 0) {
+                    return false;
+                }
+
+                m_unit = m_callUnits[--m_callDepth];
+                moveTo(m_callStack[m_callDepth]);
+                break;
+
+            case Opcode::SET:
+            case Opcode::ADD:
+            case Opcode::CMP: {
+                const ScriptOperands& operands = program.operands(current.m_value);
+                int32_t value = operands.m_source == ScriptOperands::NO_REGISTER ?
+                                operands.m_immediate : m_registers[operands.m_source];
+                int32_t& target = m_registers[operands.m_register];
+
+                if (current.m_opcode == Opcode::SET) {
+                    target = value;
+                } else if (current.m_opcode == Opcode::ADD) {
+                    // Wraps around instead of overflowing
+                    target = static_cast<int32_t>(static_cast<uint32_t>(target) + static_cast<uint32_t>(value));
+                } else {
+                    m_compare = (target > value) - (target < value);
+                }
+
+                moveTo(m_currentLine + 1);
+                break;
+            }
+
+            case Opcode::BRANCH:
+                moveTo(condition(current.m_symbol) ? current.m_value : m_currentLine + 1);
+                break;
+
+            case Opcode::SWITCH: {
+                // A value outside of the table continues with the next line
+                uint32_t index = m_registers[program.jumpTable(current.m_value).m_register];
+                moveTo(index < program.jumpTable(current.m_value).m_count ?
+                       program.switchTarget(current.m_value, index) : m_currentLine + 1);
+                break;
+            }
+
+            case Opcode::CALL:
+                // Only left unresolved when the label does not exist, like a jump it stays here
+                break;
+
+            case Opcode::REPEAT:
+                m_loopCounters[loops + current.m_value] = program.loop(current.m_value).m_count;
+                moveTo(m_currentLine + 1);
+                break;
+
+            case Opcode::ENDREPEAT:
+                // A loop entered by jumping into it has no iterations left and runs once
+                if (m_loopCounters[loops + current.m_value] > 1) {
+                    m_loopCounters[loops + current.m_value]--;
+                    moveTo(program.loop(current.m_value).m_body);
+                } else {
+                    m_loopCounters[loops + current.m_value] = 0;
+                    moveTo(m_currentLine + 1);
+                }
+
+                break;
+
+            case Opcode::WAIT: {
+                int32_t millisToWait = OptValue(m_currentLine, "", program.value(current));
+
+                if (wait(millis(), millisToWait)) {
+                    moveTo(m_currentLine + 1);
+                } else {
+                    // Sleep till the wait is over so a runner can put this context on it's timer list
+                    sleepUntil(m_requestedStart + millisToWait + 1);
+                }
+
+                break;
+            }
+
+            default:
+                moveTo(m_currentLine + 1);
+        }
+
+        return true;
+    }
+};
+
+typedef BasicContext<> Context;
+
+/**
+ * What a command wants to happen after it executed
+ * A bool converts to a result, true advances to the next line and false retries the command on the next tick,
+ * so commands that return a bool keep working
+ */
+class CommandResult {
+public:
+    enum class Action : uint8_t {
+        RETRY,
+        ADVANCE,
+        SLEEP
+    };
+
+private:
+    Action m_action;
+    uint32_t m_wakeAt;
+
+    CommandResult(Action p_action, uint32_t p_wakeAt) : m_action(p_action), m_wakeAt(p_wakeAt) {
+    }
+
+public:
+    CommandResult(bool p_advance) : m_action(p_advance ? Action::ADVANCE : Action::RETRY), m_wakeAt(0) {
+    }
+
+    static CommandResult advance() {
+        return CommandResult(Action::ADVANCE, 0);
+    }
+
+    static CommandResult retry() {
+        return CommandResult(Action::RETRY, 0);
+    }
+
+    /**
+     * Run the command again, but not before millis() reached wakeAt
+     */
+    static CommandResult sleepUntil(uint32_t wakeAt) {
+        return CommandResult(Action::SLEEP, wakeAt);
+    }
+
+    /**
+     * Run the command again after millisToSleep milli seconds
+     */
+    static CommandResult sleepFor(uint32_t millisToSleep) {
+        return CommandResult(Action::SLEEP, millis() + millisToSleep);
+    }
+
+    Action action() const {
+        return m_action;
+    }
+
+    uint32_t wakeAt() const {
+        return m_wakeAt;
+    }
+};
+
+/**
+ * Simpel state that gets run each time the StateMachine reaches this state
+ *
+ * Threading: a context is only ever handled by one thread at a time, but runners that use threads
+ * (WorkStealingRunner) call the same Command for different contexts concurrently.
+ * A command must therefore only change the context it is given, any other state it touches must be
+ * synchronised by the command itself.
+ */
+template<typename ContextType>
+class Command {
+    //    friend class ScriptRunner;
+public:
+    typedef std::function<CommandResult (const OptValue&, ContextType& context)> TRunFunction;
+
+    TRunFunction m_run;
+    const char* m_command;
+    SymbolId m_symbol;
+
+private:
+
+public:
+
+    Command(const char* p_command, const TRunFunction& p_run) :
+        m_run(p_run),
+        m_command(p_command),
+        m_symbol(SymbolTable::instance().intern(p_command)) {
+    }
+
+    virtual ~Command() {
+    }
+
+    bool canExecute(SymbolId symbol) const {
+        return symbol == m_symbol;
+    }
+
+    bool canExecute(const OptValue& execLine) const {
+        return execLine.key() == SymbolTable::instance().name(m_symbol) ||
+               strcmp(execLine.key(), m_command) == 0;
+    }
+
+    virtual CommandResult execute(const OptValue& execLine, ContextType& context) {
+        return m_run(execLine, context);
+    }
+
+};
+
+/**
+ * StateMachine itself that will run through all states
+ */
+template<typename ContextType, typename Allocator = std::allocator<char>>
+class ScriptRunner : public BasicContext<typename ContextType::allocator_type>::CommandDispatcher {
+public:
+    typedef std::function<void (ContextType& context)> TFinishedFunction;
+
+private:
+    typedef Command<ContextType>* CommandContextPtr;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<CommandContextPtr> CommandAllocator;
+    typedef BasicContext<typename ContextType::allocator_type> ContextBase;
+    std::vector<CommandContextPtr, CommandAllocator> m_commands;
+
+    enum {
+        // Signals that can be posted before the runner picks them up
+        POSTED_SIGNALS = 8
+    };
+
+    // Contexts started on this runner that are handled every tick, in the order they where started
+    ContextBase* m_firstRunning;
+    ContextBase* m_lastRunning;
+    // Contexts waiting for an event without timeout
+    ContextBase* m_firstParked;
+    // Contexts sleeping or waiting for an event with a timeout, ordered by wake up time
+    ContextBase* m_firstTimer;
+    RequestQueue m_requests;
+    std::atomic<SymbolId> m_postedSignals[POSTED_SIGNALS];
+    TFinishedFunction m_finished;
+    SchedulingPolicy m_policy;
+
+    bool hasCommand(SymbolId symbol) const {
+        for (const CommandContextPtr value : m_commands) {
+            if (value->canExecute(symbol)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Run the commands for symbol, returns true when the context should go to the next line
+     */
+    bool execute(ContextType& context, SymbolId symbol, const OptValue& line, CommandResult& result) const {
+        bool hasRan = false;
+
+        for (const CommandContextPtr value : m_commands) {
+            if (value->canExecute(symbol)) {
+                result = value->execute(line, context);
+                hasRan = true;
+            }
+        }
+
+        if (result.action() == CommandResult::Action::SLEEP) {
+            context.sleepUntil(result.wakeAt());
+            return false;
+        }
+
+        return result.action() == CommandResult::Action::ADVANCE || !hasRan;
+    }
+
+    static bool due(uint32_t deadline, uint32_t now) {
+        return static_cast<int32_t>(now - deadline) >= 0;
+    }
+
+    static constexpr uint32_t REQUEST_BITS = 4;
+    static constexpr uint32_t REQUEST_MASK = (1u << REQUEST_BITS) - 1;
+    static constexpr uint32_t MAX_REQUESTS = 32 / REQUEST_BITS;
+
+    void post(ContextType& context, RunnerRequest request) {
+        uint32_t requests = context.m_postedRequests.load();
+        uint32_t posted;
+
+        do {
+            uint32_t count = 0;
+
+            while (count < MAX_REQUESTS && ((requests >> (count * REQUEST_BITS)) & REQUEST_MASK) != 0) {
+                count++;
+            }
+
+            uint32_t last = count == 0 ? 0 : (requests >> ((count - 1) * REQUEST_BITS)) & REQUEST_MASK;
+
+            if (last == static_cast<uint32_t>(request)) {
+                // Posting the same request twice in a row does nothing more than posting it once
+                posted = requests;
+                break;
+            }
+
+            // When all slots are taken the newest request replaces the last one
+            uint32_t slot = count == MAX_REQUESTS ? count - 1 : count;
+            posted = (requests & ~(REQUEST_MASK << (slot * REQUEST_BITS))) |
+                     (static_cast<uint32_t>(request) << (slot * REQUEST_BITS));
+        } while (!context.m_postedRequests.compare_exchange_weak(requests, posted));
+
+        // A context is queued at most once, a queued context applies all requests posted so far when it's drained
+        if (!context.m_requestQueued.exchange(true)) {
+            context.m_requestNode.m_owner = &context;
+            m_requests.push(&context.m_requestNode);
+        }
+    }
+
+    void linkRunning(ContextBase& context, RunState state) {
+        context.m_nextLinked = nullptr;
+        context.m_runState = state;
+
+        if (m_lastRunning == nullptr) {
+            m_firstRunning = &context;
+        } else {
+            m_lastRunning->m_nextLinked = &context;
+        }
+
+        m_lastRunning = &context;
+    }
+
+    void unlinkRunning(ContextBase* previous, ContextBase& context) {
+        if (previous == nullptr) {
+            m_firstRunning = context.m_nextLinked;
+        } else {
+            previous->m_nextLinked = context.m_nextLinked;
+        }
+
+        if (m_lastRunning == &context) {
+            m_lastRunning = previous;
+        }
+
+        context.m_nextLinked = nullptr;
+    }
+
+    static bool remove(ContextBase*& first, ContextBase& context) {
+        for (ContextBase** link = &first; *link != nullptr; link = &(*link)->m_nextLinked) {
+            if (*link == &context) {
+                *link = context.m_nextLinked;
+                context.m_nextLinked = nullptr;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Take context out of whatever list it is in
+     */
+    void unlink(ContextBase& context) {
+        ContextBase* previous = nullptr;
+
+        for (ContextBase* current = m_firstRunning; current != nullptr; current = current->m_nextLinked) {
+            if (current == &context) {
+                unlinkRunning(previous, context);
+                return;
+            }
+
+            previous = current;
+        }
+
+        if (!remove(m_firstParked, context)) {
+            remove(m_firstTimer, context);
+        }
+    }
+
+    /**
+     * Move a context that sleeps or started waiting for an event out of the running list
+     */
+    void park(ContextBase& context) {
+        context.m_runState = RunState::WAITING;
+
+        if (!context.m_sleeping && context.m_eventTimeout == 0) {
+            context.m_nextLinked = m_firstParked;
+            m_firstParked = &context;
+            return;
+        }
+
+        ContextBase** link = &m_firstTimer;
+
+        while (*link != nullptr && !due(context.m_wakeAt, (*link)->m_wakeAt)) {
+            link = &(*link)->m_nextLinked;
+        }
+
+        context.m_nextLinked = *link;
+        *link = &context;
+    }
+
+    void signalList(ContextBase*& first, SymbolId event) {
+        ContextBase** link = &first;
+
+        while (*link != nullptr) {
+            ContextBase& context = **link;
+
+            if (context.signal(event)) {
+                *link = context.m_nextLinked;
+                linkRunning(context, RunState::RUNNING);
+            } else {
+                link = &context.m_nextLinked;
+            }
+        }
+    }
+
+    /**
+     * Wake the contexts whose timer expired, but only once the slack of one of them is used up.
+     * All expired timers are then handled together
+     */
+    void expireTimers(uint32_t now) {
+        bool slackUsed = false;
+
+        for (ContextBase* timer = m_firstTimer; timer != nullptr && due(timer->m_wakeAt, now); timer = timer->m_nextLinked) {
+            if (due(timer->m_wakeAt + timer->m_timerSlack, now)) {
+                slackUsed = true;
+                break;
+            }
+        }
+
+        if (!slackUsed) {
+            return;
+        }
+
+        while (m_firstTimer != nullptr && due(m_firstTimer->m_wakeAt, now)) {
+            ContextBase& context = *m_firstTimer;
+            m_firstTimer = context.m_nextLinked;
+
+            if (context.m_eventState == EventState::WAITING) {
+                context.m_eventState = EventState::TIMED_OUT;
+            }
+
+            context.m_sleeping = false;
+            linkRunning(context, RunState::RUNNING);
+        }
+    }
+
+    /**
+     * Run one line of current, returns false when it left the running list because it finished or started waiting
+     */
+    bool step(ContextBase* previous, ContextBase& current) {
+        if (current.m_runState != RunState::RUNNING) {
+            return true;
+        }
+
+        if (!handle(static_cast<ContextType&>(current))) {
+            unlinkRunning(previous, current);
+            current.m_runState = RunState::STOPPED;
+
+            if (m_finished) {
+                m_finished(static_cast<ContextType&>(current));
+            }
+
+            return false;
+        }
+
+        if (current.m_eventState == EventState::WAITING || current.m_sleeping) {
+            unlinkRunning(previous, current);
+            park(current);
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * True when a must be handled before b according to the scheduling policy
+     */
+    bool before(const ContextBase& a, const ContextBase& b) const {
+        if (m_policy == SchedulingPolicy::EARLIEST_DEADLINE) {
+            if (a.m_hasDeadline != b.m_hasDeadline) {
+                return a.m_hasDeadline;
+            }
+
+            if (a.m_hasDeadline && a.m_deadline != b.m_deadline) {
+                return static_cast<int32_t>(a.m_deadline - b.m_deadline) < 0;
+            }
+        }
+
+        return m_policy != SchedulingPolicy::ROUND_ROBIN && a.m_priority > b.m_priority;
+    }
+
+    bool sameRank(const ContextBase& a, const ContextBase& b) const {
+        return !before(a, b) && !before(b, a);
+    }
+
+    /**
+     * Stable sort of the running list, the list is mostly sorted already so this is close to linear
+     */
+    void sortRunning() {
+        if (m_policy == SchedulingPolicy::ROUND_ROBIN) {
+            return;
+        }
+
+        ContextBase* first = nullptr;
+        ContextBase* last = nullptr;
+        ContextBase* current = m_firstRunning;
+
+        while (current != nullptr) {
+            ContextBase* next = current->m_nextLinked;
+
+            if (last == nullptr || !before(*current, *last)) {
+                current->m_nextLinked = nullptr;
+
+                if (last == nullptr) {
+                    first = current;
+                } else {
+                    last->m_nextLinked = current;
+                }
+
+                last = current;
+            } else {
+                ContextBase** link = &first;
+
+                while (!before(*current, **link)) {
+                    link = &(*link)->m_nextLinked;
+                }
+
+                current->m_nextLinked = *link;
+                *link = current;
+            }
+
+            current = next;
+        }
+
+        m_firstRunning = first;
+        m_lastRunning = last;
+    }
+
+    /**
+     * Move the contexts of the same rank as current that where handled before it behind the others of that rank,
+     * so the next call starts with current. With ROUND_ROBIN all contexts have the same rank
+     */
+    void rotate(ContextBase* previous, ContextBase& current) {
+        if (previous == nullptr) {
+            return;
+        }
+
+        ContextBase* beforeRank = nullptr;
+        ContextBase* firstOfRank = m_firstRunning;
+
+        while (!sameRank(*firstOfRank, current)) {
+            beforeRank = firstOfRank;
+            firstOfRank = firstOfRank->m_nextLinked;
+        }
+
+        if (firstOfRank == &current) {
+            return;
+        }
+
+        ContextBase* lastOfRank = &current;
+
+        while (lastOfRank->m_nextLinked != nullptr && sameRank(*lastOfRank->m_nextLinked, current)) {
+            lastOfRank = lastOfRank->m_nextLinked;
+        }
+
+        if (beforeRank == nullptr) {
+            m_firstRunning = &current;
+        } else {
+            beforeRank->m_nextLinked = &current;
+        }
+
+        previous->m_nextLinked = lastOfRank->m_nextLinked;
+        lastOfRank->m_nextLinked = firstOfRank;
+
+        if (m_lastRunning == lastOfRank) {
+            m_lastRunning = previous;
+        }
+    }
+
+    void applySignals() {
+        for (auto& posted : m_postedSignals) {
+            SymbolId event = posted.exchange(SymbolTable::NOT_FOUND);
+
+            if (event != SymbolTable::NOT_FOUND) {
+                signal(event);
+            }
+        }
+    }
+
+    void applyRequests() {
+        RequestNode* node;
+
+        while ((node = m_requests.pop()) != nullptr) {
+            ContextType& context = *static_cast<ContextType*>(node->m_owner);
+            context.m_requestQueued.store(false);
+            uint32_t requests = context.m_postedRequests.exchange(0);
+
+            // Requests are applied in the order they were posted, so a START followed by a PAUSE starts the context paused
+            for (; requests != 0; requests >>= REQUEST_BITS) {
+                applyRequest(context, static_cast<RunnerRequest>(requests & REQUEST_MASK));
+            }
+        }
+    }
+
+    void applyRequest(ContextType& context, RunnerRequest request) {
+        switch (request) {
+            case RunnerRequest::START:
+                if (context.m_runState == RunState::STOPPED) {
+                    linkRunning(context, RunState::RUNNING);
+                }
+
+                break;
+
+            case RunnerRequest::ABORT:
+                if (context.m_runState != RunState::STOPPED) {
+                    unlink(context);
+                    context.m_runState = RunState::STOPPED;
+                }
+
+                break;
+
+            case RunnerRequest::PAUSE:
+                if (context.m_runState == RunState::RUNNING) {
+                    context.m_runState = RunState::PAUSED;
+                } else if (context.m_runState == RunState::WAITING) {
+                    // Once resumed the waiting command runs again and parks the context with it's original deadline
+                    unlink(context);
+                    linkRunning(context, RunState::PAUSED);
+                }
+
+                break;
+
+            case RunnerRequest::RESUME:
+                if (context.m_runState == RunState::PAUSED) {
+                    context.m_runState = RunState::RUNNING;
+                }
+
+                break;
+
+            default:
+                break;
+        }
+    }
+
+public:
+    ScriptRunner(const std::vector<CommandContextPtr>& p_commands, const Allocator& p_allocator = Allocator()) :
+        m_commands(p_commands.begin(), p_commands.end(), CommandAllocator(p_allocator)),
+        m_firstRunning(nullptr),
+        m_lastRunning(nullptr),
+        m_firstParked(nullptr),
+        m_firstTimer(nullptr),
+        m_policy(SchedulingPolicy::ROUND_ROBIN) {
+        for (auto& posted : m_postedSignals) {
+            posted.store(SymbolTable::NOT_FOUND);
+        }
+    }
+
+    virtual ~ScriptRunner() {
+    }
+
+    /**
+     * Start, abort, pause or resume a context on this runner.
+     * These only post a request that is applied at the start of the next handle(), they are lock free and
+     * do not allocate so they can be called from other threads and interrupt handlers.
+     * Requests are applied in the order they were posted, up to 8 per context between two calls to handle(),
+     * beyond that the newest request replaces the last one
+     * An aborted context stays at the line it was on, reset() it to run it again from the start
+     */
+    void start(ContextType& context) {
+        post(context, RunnerRequest::START);
+    }
+
+    void abort(ContextType& context) {
+        post(context, RunnerRequest::ABORT);
+    }
+
+    void pause(ContextType& context) {
+        post(context, RunnerRequest::PAUSE);
+    }
+
+    void resume(ContextType& context) {
+        post(context, RunnerRequest::RESUME);
+    }
+
+    /**
+     * Wake all contexts started on this runner that wait for event, the woken contexts are handled in the next tick.
+     * Signals are not remembered, contexts that start waiting later will not see it.
+     * Must be called from the thread that calls handle(), use postSignal() from other threads and interrupt handlers
+     */
+    void signal(SymbolId event) {
+        signalList(m_firstParked, event);
+        signalList(m_firstTimer, event);
+    }
+
+    /**
+     * Signal event by name, the name is only looked up. Returns false when it was never interned, nothing can wait for it
+     */
+    bool signal(const char* event) {
+        SymbolId id = SymbolTable::instance().find(event);
+
+        if (id == SymbolTable::NOT_FOUND) {
+            return false;
+        }
+
+        signal(id);
+        return true;
+    }
+
+    /**
+     * Signal event from another thread or an interrupt handler, the signal is applied at the start of the next handle().
+     * Lock free and does not allocate, returns false when too many different signals are pending already
+     */
+    bool postSignal(SymbolId event) {
+        for (auto& posted : m_postedSignals) {
+            SymbolId expected = SymbolTable::NOT_FOUND;
+
+            if (posted.compare_exchange_strong(expected, event) || expected == event) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Select the order in which started contexts are handled, priorities and deadlines are read from the contexts
+     * at the start of every handle() so commands may change them while running
+     */
+    void schedulingPolicy(SchedulingPolicy p_policy) {
+        m_policy = p_policy;
+    }
+
+    SchedulingPolicy schedulingPolicy() const {
+        return m_policy;
+    }
+
+    /**
+     * Called from handle() when a started context reaches it's end
+     */
+    void onFinished(const TFinishedFunction& p_finished) {
+        m_finished = p_finished;
+    }
+
+    /**
+     * Apply all posted requests and signals and run one line of every started context that is not paused
+     * or waiting for an event. Returns true as long as contexts are started on this runner
+     * Must only be called from a single thread
+     */
+    bool handle() {
+        applyRequests();
+        applySignals();
+        expireTimers(millis());
+        sortRunning();
+        ContextBase* previous = nullptr;
+        ContextBase* current = m_firstRunning;
+
+        while (current != nullptr) {
+            ContextBase* next = current->m_nextLinked;
+
+            if (step(previous, *current)) {
+                previous = current;
+            }
+
+            current = next;
+        }
+
+        return started();
+    }
+
+    /**
+     * Like handle() but keeps running lines, taking turns between the contexts, until maxLines lines ran or
+     * maxMicros micro seconds passed, whichever comes first (0 is no limit).
+     * It also returns when a full round did not move any context to another line, so waiting contexts do not eat the budget.
+     * The next call continues with the context that was next in line, so all contexts get their share.
+     * This keeps the time spend in loop() bounded, for example to keep the ESP8266 watchdog and WiFi happy
+     */
+    bool handle(uint16_t maxLines, uint32_t maxMicros = 0) {
+        if (maxLines == 0 && maxMicros == 0) {
+            return handle();
+        }
+
+        applyRequests();
+        applySignals();
+        uint32_t startMicros = micros();
+        uint16_t lines = 0;
+        bool progress = true;
+
+        while (progress) {
+            progress = false;
+            expireTimers(millis());
+            sortRunning();
+            ContextBase* previous = nullptr;
+            ContextBase* current = m_firstRunning;
+
+            while (current != nullptr) {
+                if ((maxLines != 0 && lines >= maxLines) ||
+                    (maxMicros != 0 && micros() - startMicros >= maxMicros)) {
+                    rotate(previous, *current);
+                    return started();
+                }
+
+                ContextBase* next = current->m_nextLinked;
+                ScriptOffset line = current->m_currentLine;
+                bool running = current->m_runState == RunState::RUNNING;
+
+                if (step(previous, *current)) {
+                    previous = current;
+                    progress |= current->m_currentLine != line;
+                } else {
+                    progress = true;
+                }
+
+                lines += running;
+                current = next;
+            }
+        }
+
+        return started();
+    }
+
+    /**
+     * Time in millis() at which handle() has work to do again, so the caller can sleep until then.
+     * This is now when a started context is running, the moment the first timer expires including it's slack otherwise.
+     * Returns false when no started context will become runnable by time, only a signal or request can wake them
+     */
+    bool nextWakeup(uint32_t& wakeAt) const {
+        for (ContextBase* current = m_firstRunning; current != nullptr; current = current->m_nextLinked) {
+            if (current->m_runState == RunState::RUNNING) {
+                wakeAt = millis();
+                return true;
+            }
+        }
+
+        if (m_firstTimer == nullptr) {
+            return false;
+        }
+
+        wakeAt = m_firstTimer->m_wakeAt + m_firstTimer->m_timerSlack;
+
+        // Ordered by wake up time, timers that expire after the best so far can not end earlier
+        for (ContextBase* timer = m_firstTimer->m_nextLinked; timer != nullptr && !due(wakeAt, timer->m_wakeAt);
+             timer = timer->m_nextLinked) {
+            uint32_t fireAt = timer->m_wakeAt + timer->m_timerSlack;
+
+            if (!due(wakeAt, fireAt)) {
+                wakeAt = fireAt;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * True as long as contexts are started on this runner
+     */
+    bool started() const {
+        return m_firstRunning != nullptr || m_firstParked != nullptr || m_firstTimer != nullptr;
+    }
+
+    /**
+     * Keep running the script
+     * Run's true as long as the script is still running
+     * handle() does not allocate, all memory is taken when the context and runner are constructed
+     * handle() does not change the runner, so it can be called from several threads for different contexts
+     */
+    bool handle(ContextType& context) const {
+        if (context.m_sleeping) {
+            if (!due(context.m_wakeAt, millis())) {
+                return true;
+            }
+
+            context.m_sleeping = false;
+        }
+
+        if (context.m_compiled != nullptr) {
+            return context.m_compiled(context, *this);
+        }
+
+        if (context.m_program == nullptr) {
+            // Created without a script and never given one
+            return false;
+        }
+
+        SymbolId symbol = context.currentSymbol();
+
+        // Most lines are built-in's without a command, those don't need the text of the line
+        if (hasCommand(symbol)) {
+            CommandResult result = CommandResult::retry();
+            // Built here instead of kept in the context, so it does not change under a command that moves the context
+            OptValue line = context.currentLine();
+            context.m_jumped = false;
+
+            // A command that jumped continues on the line it jumped to, even when it asked to advance
+            if (!execute(context, symbol, line, result) || context.m_jumped) {
+                return true;
+            }
+        }
+
+        return context.advance();
+    }
+
+    /**
+     * Commands of a script translated to C++, see BasicContext::setCompiledScript()
+     */
+    bool command(ContextBase& context, SymbolId symbol, const OptValue& line, ScriptOffset next) const override {
+        CommandResult result = CommandResult::retry();
+        context.m_jumped = false;
+
+        if (execute(static_cast<ContextType&>(context), symbol, line, result) && !context.m_jumped) {
+            context.moveTo(next);
+        }
+
+        return true;
     }
 
 };
@@ -0,0 +1,338 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "scriptrunner.hpp"
+#include "spscqueue.hpp"
+
+namespace rvt {
+
+namespace scriptrunner {
+
+/**
+ * Splits contexts over a number of independent shards, intended for host side simulations.
+ * Each shard has it's own thread, ScriptRunner and list of contexts and on Linux it's thread is pinned to a core.
+ * Shards never look at each others data, contexts are handed to a shard through bounded single producer single
+ * consumer queues. There is one queue for every pair of shards and one from the controlling thread to each shard.
+ * A shard starts the contexts it receives on it's ScriptRunner, so waits, events, timer slack and scheduling work
+ * like on any runner, and sleeps until a context arrives or the runner's next wake up when nothing is running.
+ * The commands are shared between the shards, see Command for the threading contract.
+ * Contexts are not owned by the runner and must stay alive until they finished or the runner is destroyed
+ */
+template<typename ContextType, size_t QueueCapacity = 256, typename Allocator = std::allocator<char>>
+class ShardedRunner {
+public:
+    enum : size_t {
+        NO_SHARD = SIZE_MAX
+    };
+
+private:
+    typedef SpscQueue<ContextType*, QueueCapacity> Queue;
+
+    struct Shard {
+        ScriptRunner<ContextType, Allocator> m_runner;
+        // Written only by the shard's own thread
+        std::atomic<size_t> m_sent;
+        std::atomic<size_t> m_finished;
+        // Contexts pushed to the queues of this shard and not yet received, counted before they are pushed
+        std::atomic<size_t> m_pending;
+        std::atomic<bool> m_sleeping;
+        // Set when something else than a context was posted to the runner, like a signal
+        std::atomic<bool> m_kicked;
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::thread m_thread;
+
+        Shard(const std::vector<Command<ContextType>*>& p_commands) :
+            m_runner(p_commands),
+            m_sent(0),
+            m_finished(0),
+            m_pending(0),
+            m_sleeping(false),
+            m_kicked(false) {
+        }
+
+        void wake() {
+            if (m_sleeping) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_wake.notify_one();
+            }
+        }
+    };
+
+    // The shard the current thread runs, only for the runner it belongs to
+    struct CurrentShard {
+        const ShardedRunner* m_runner;
+        size_t m_shard;
+    };
+
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    // m_queues[from * shards + to], from == shards is the controlling thread
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::atomic<size_t> m_controllerSent;
+    size_t m_nextShard;
+    std::atomic<bool> m_stop;
+    // wait() blocks on m_done, shards only take the mutex to notify while the controlling thread waits
+    mutable std::atomic<bool> m_waiting;
+    mutable std::mutex m_doneMutex;
+    mutable std::condition_variable m_done;
+
+    static CurrentShard& currentShardSlot() {
+        static thread_local CurrentShard s_currentShard = {nullptr, NO_SHARD};
+        return s_currentShard;
+    }
+
+    Queue& queue(size_t from, size_t to) {
+        return *m_queues[from * m_shards.size() + to];
+    }
+
+    bool push(size_t from, size_t to, ContextType* context) {
+        Shard& target = *m_shards[to];
+        target.m_pending++;
+
+        if (!queue(from, to).push(context)) {
+            target.m_pending--;
+            return false;
+        }
+
+        target.wake();
+        return true;
+    }
+
+    // Called after a change that can make the runner idle
+    void notifyDone() {
+        if (m_waiting) {
+            std::lock_guard<std::mutex> lock(m_doneMutex);
+            m_done.notify_one();
+        }
+    }
+
+    void receive(size_t self) {
+        Shard& shard = *m_shards[self];
+        ContextType* context;
+
+        for (size_t from = 0; from <= m_shards.size(); from++) {
+            while (queue(from, self).pop(context)) {
+                shard.m_pending--;
+                shard.m_runner.start(*context);
+            }
+        }
+    }
+
+    /**
+     * Block until a context arrives, or until the runner has work again when it has a timer
+     */
+    void sleep(Shard& shard) {
+        uint32_t wakeAt = 0;
+        bool timer = shard.m_runner.nextWakeup(wakeAt);
+        int32_t left = timer ? static_cast<int32_t>(wakeAt - millis()) : 0;
+
+        if (timer && left <= 0) {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(shard.m_mutex);
+        shard.m_sleeping = true;
+        auto ready = [this, &shard]() {
+            return m_stop || shard.m_pending != 0 || shard.m_kicked;
+        };
+
+        if (timer) {
+            shard.m_wake.wait_for(lock, std::chrono::milliseconds(left), ready);
+        } else {
+            shard.m_wake.wait(lock, ready);
+        }
+
+        shard.m_sleeping = false;
+        shard.m_kicked = false;
+    }
+
+    void run(size_t self) {
+        currentShardSlot() = CurrentShard{this, self};
+        Shard& shard = *m_shards[self];
+
+        while (!m_stop) {
+            receive(self);
+            shard.m_runner.handle();
+            sleep(shard);
+        }
+
+        currentShardSlot() = CurrentShard{nullptr, NO_SHARD};
+    }
+
+    void pin(size_t shard) {
+#ifdef __linux__
+        unsigned cores = std::thread::hardware_concurrency();
+
+        if (cores > 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(shard % cores, &set);
+            pthread_setaffinity_np(m_shards[shard]->m_thread.native_handle(), sizeof(set), &set);
+        }
+
+#endif
+    }
+
+public:
+    ShardedRunner(const std::vector<Command<ContextType>*>& p_commands,
+                  size_t p_shards = std::thread::hardware_concurrency(),
+                  bool p_pinThreads = true) :
+        m_controllerSent(0),
+        m_nextShard(0),
+        m_stop(false),
+        m_waiting(false) {
+        if (p_shards == 0) {
+            p_shards = 1;
+        }
+
+        for (size_t i = 0; i < p_shards; i++) {
+            m_shards.push_back(std::unique_ptr<Shard>(new Shard(p_commands)));
+            Shard* shard = m_shards.back().get();
+            shard->m_runner.onFinished([this, shard](ContextType&) {
+                shard->m_finished++;
+                notifyDone();
+            });
+        }
+
+        for (size_t i = 0; i < (p_shards + 1) * p_shards; i++) {
+            m_queues.push_back(std::unique_ptr<Queue>(new Queue()));
+        }
+
+        for (size_t i = 0; i < p_shards; i++) {
+            m_shards[i]->m_thread = std::thread(&ShardedRunner::run, this, i);
+
+            if (p_pinThreads) {
+                pin(i);
+            }
+        }
+    }
+
+    ShardedRunner(const ShardedRunner&) = delete;
+    ShardedRunner& operator=(const ShardedRunner&) = delete;
+
+    ~ShardedRunner() {
+        m_stop = true;
+
+        for (auto& shard : m_shards) {
+            {
+                std::lock_guard<std::mutex> lock(shard->m_mutex);
+                shard->m_wake.notify_one();
+            }
+
+            shard->m_thread.join();
+        }
+    }
+
+    /**
+     * Shard of this runner the calling thread runs, NO_SHARD when not called from one of it's shards
+     */
+    size_t currentShard() const {
+        const CurrentShard& current = currentShardSlot();
+        return current.m_runner == this ? current.m_shard : NO_SHARD;
+    }
+
+    /**
+     * Start context on shard, from the controlling thread or from a command running on any shard.
+     * Returns false when the queue to that shard is full, the caller may try again later
+     */
+    bool start(ContextType* context, size_t shard) {
+        size_t from = currentShard();
+
+        if (from == NO_SHARD) {
+            m_controllerSent++;
+
+            if (push(m_shards.size(), shard, context)) {
+                return true;
+            }
+
+            m_controllerSent--;
+            return false;
+        }
+
+        Shard& self = *m_shards[from];
+        self.m_sent++;
+
+        if (push(from, shard, context)) {
+            return true;
+        }
+
+        self.m_sent--;
+        notifyDone();
+        return false;
+    }
+
+    /**
+     * Start context from the controlling thread, shards are selected round robin
+     */
+    bool start(ContextType* context) {
+        return start(context, m_nextShard++ % m_shards.size());
+    }
+
+    /**
+     * True when every started context has finished
+     */
+    bool idle() const {
+        size_t finished = 0;
+
+        // Finished must be read before sent, every finished context has been counted as sent before
+        for (auto& shard : m_shards) {
+            finished += shard->m_finished;
+        }
+
+        size_t sent = m_controllerSent;
+
+        for (auto& shard : m_shards) {
+            sent += shard->m_sent;
+        }
+
+        return sent == finished;
+    }
+
+    /**
+     * Block the controlling thread until all started contexts have reached their end
+     */
+    void wait() const {
+        std::unique_lock<std::mutex> lock(m_doneMutex);
+        m_waiting = true;
+        m_done.wait(lock, [this]() {
+            return idle();
+        });
+        m_waiting = false;
+    }
+
+    size_t shards() const {
+        return m_shards.size();
+    }
+
+    /**
+     * Wake the contexts of all shards that wait for event, from the controlling thread or any shard.
+     * Like on ScriptRunner signals are not remembered, returns false when a shard has too many signals pending
+     */
+    bool signal(SymbolId event) {
+        bool posted = true;
+
+        for (auto& shard : m_shards) {
+            posted = shard->m_runner.postSignal(event) && posted;
+            shard->m_kicked = true;
+            shard->wake();
+        }
+
+        return posted;
+    }
+};
+
+}
+}
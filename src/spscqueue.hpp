@@ -0,0 +1,70 @@
+#pragma once
+#include <stddef.h>
+#include <atomic>
+
+namespace rvt {
+
+namespace scriptrunner {
+
+/**
+ * Bounded wait free queue for exactly one producer and one consumer
+ * The producer only writes m_head and the consumer only writes m_tail, so neither side ever waits on the other.
+ * Capacity must be a power of two, one slot is kept free to tell a full queue from an empty one
+ */
+template<typename T, size_t Capacity>
+class SpscQueue {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+    T m_items[Capacity];
+    std::atomic<size_t> m_head;
+    std::atomic<size_t> m_tail;
+
+public:
+    SpscQueue() : m_head(0), m_tail(0) {
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    /**
+     * Producer side, returns false when the queue is full
+     */
+    bool push(const T& item) {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t next = (head + 1) & (Capacity - 1);
+
+        if (next == m_tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        m_items[head] = item;
+        m_head.store(next, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Consumer side, returns false when the queue is empty
+     */
+    bool pop(T& item) {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+
+        if (tail == m_head.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        item = m_items[tail];
+        m_tail.store((tail + 1) & (Capacity - 1), std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return m_tail.load(std::memory_order_acquire) == m_head.load(std::memory_order_acquire);
+    }
+
+    static constexpr size_t capacity() {
+        return Capacity - 1;
+    }
+};
+
+}
+}
@@ -0,0 +1,639 @@
+#pragma once
+/**
+ * Optional compile time parsing of scripts that are string literals.
+ * Only available with C++17 or newer, the rest of the library stays C++11
+ */
+#if __cplusplus >= 201703L
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits>
+
+#include "scriptrunner.hpp"
+#include "programmemory.hpp"
+
+namespace rvt {
+
+namespace scriptrunner {
+
+/**
+ * A line of a StaticProgram, everything the interpreter works out when it loads a script is stored in the line.
+ * key and value are offsets into the text of the program. target is the line a goto, gosub or branch continues with,
+ * the body of an endrepeat or the first jump table entry of a switch.
+ * loop is the number of the loop of a repeat or endrepeat, count the iterations of a repeat, the entries of a switch
+ * or the milli seconds of a wait
+ */
+struct StaticLine {
+    Opcode m_opcode = Opcode::COMMAND;
+    SymbolId m_symbol = SymbolTable::EMPTY;
+    uint8_t m_register = 0;
+    uint8_t m_source = ScriptOperands::NO_REGISTER;
+    ScriptOffset m_key = 0;
+    ScriptOffset m_value = 0;
+    ScriptOffset m_target = 0;
+    ScriptOffset m_loop = 0;
+    uint32_t m_count = 0;
+    int32_t m_immediate = 0;
+};
+
+/**
+ * A script parsed by the compiler, see SCRIPTRUNNER_STATIC_SCRIPT. Lines, Size and Targets are upper bounds
+ * worked out from the text, size() is the number of lines used
+ */
+template<size_t Lines, size_t Size, size_t Targets>
+struct StaticProgram {
+    static_assert(Lines <= std::numeric_limits<ScriptOffset>::max() && Size <= std::numeric_limits<ScriptOffset>::max(),
+                  "Script too long for SCRIPTRUNNER_OFFSET_TYPE");
+
+    StaticLine m_lines[Lines] = {};
+    // The script with a \0 after every key and value
+    char m_text[Size + 1] = {};
+    // Jump tables of the switches
+    ScriptOffset m_targets[Targets] = {};
+    ScriptOffset m_labelNames[Lines] = {};
+    ScriptOffset m_labelLines[Lines] = {};
+    size_t m_labelCount = 0;
+    size_t m_size = 0;
+    size_t m_loops = 0;
+
+    constexpr size_t size() const {
+        return m_size;
+    }
+
+    constexpr size_t loops() const {
+        return m_loops;
+    }
+
+    constexpr const StaticLine& line(size_t index) const {
+        return m_lines[index];
+    }
+
+    constexpr const char* string(ScriptOffset offset) const {
+        return m_text + offset;
+    }
+};
+
+namespace detail {
+
+/**
+ * Names of the built-in instructions by SymbolTable id
+ */
+constexpr const char* s_builtins[] = {
+    "", "end", "jump", "wait", "label", "repeat", "endrepeat", "call", "return", "set", "add", "cmp",
+    "jeq", "jne", "jlt", "jle", "jgt", "jge", "jtrue", "jfalse", "switch"
+};
+
+static_assert(sizeof(s_builtins) / sizeof(s_builtins[0]) == SymbolTable::LAST_INSTRUCTION + 1,
+              "every built-in instruction needs a name");
+
+constexpr bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+constexpr bool equals(const char* a, const char* b) {
+    for (; *a && *a == *b; a++, b++) {
+    }
+
+    return *a == *b;
+}
+
+constexpr bool number(const char* text, uint32_t& value) {
+    value = 0;
+
+    if (*text == '\0') {
+        return false;
+    }
+
+    for (; *text; text++) {
+        if (*text < '0' || *text > '9') {
+            return false;
+        }
+
+        value = value * 10 + (*text - '0');
+    }
+
+    return true;
+}
+
+constexpr bool integer(const char* text, int32_t& value) {
+    bool negative = *text == '-';
+    uint32_t magnitude = 0;
+
+    if (negative || *text == '+') {
+        text++;
+    }
+
+    if (!number(text, magnitude)) {
+        return false;
+    }
+
+    value = negative ? -static_cast<int32_t>(magnitude) : static_cast<int32_t>(magnitude);
+    return true;
+}
+
+/**
+ * Like atol(), the digits at the start of text
+ */
+constexpr int32_t leadingInteger(const char* text) {
+    bool negative = *text == '-';
+    uint32_t value = 0;
+
+    if (negative || *text == '+') {
+        text++;
+    }
+
+    for (; *text >= '0' && *text <= '9'; text++) {
+        value = value * 10 + (*text - '0');
+    }
+
+    return negative ? -static_cast<int32_t>(value) : static_cast<int32_t>(value);
+}
+
+constexpr bool registerIndex(const char*& text, uint8_t& index) {
+    uint32_t value = 0;
+
+    if (text[0] != 'r' || text[1] < '0' || text[1] > '9') {
+        return false;
+    }
+
+    for (text++; *text >= '0' && *text <= '9'; text++) {
+        value = value * 10 + (*text - '0');
+
+        if (value >= SCRIPTRUNNER_REGISTERS) {
+            return false;
+        }
+    }
+
+    index = value;
+    return true;
+}
+
+constexpr size_t trimmedLength(const char* start, const char* end) {
+    while (start < end && isSpace(*start)) {
+        start++;
+    }
+
+    while (end > start && isSpace(end[-1])) {
+        end--;
+    }
+
+    return end - start;
+}
+
+template<typename Program>
+constexpr bool findLabel(const Program& program, const char* name, size_t length, size_t& line) {
+    for (size_t i = 0; i < program.m_labelCount; i++) {
+        const char* label = program.string(program.m_labelNames[i]);
+        size_t j = 0;
+
+        for (; j < length && label[j] == name[j]; j++) {
+        }
+
+        if (j == length && label[j] == '\0') {
+            // Labels are not run, they are only there to be jumped to
+            line = program.m_labelLines[i] + 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+template<typename Program>
+constexpr bool findLabel(const Program& program, const char* name, size_t& line) {
+    size_t length = 0;
+
+    while (name[length]) {
+        length++;
+    }
+
+    return findLabel(program, name, length, line);
+}
+
+}
+
+/**
+ * Upper bounds for the tables of a StaticProgram
+ */
+constexpr size_t staticLines(const char* script) {
+    // Every ; ends a line, plus the last line and the end line that is added
+    size_t lines = 2;
+
+    for (; *script; script++) {
+        lines += *script == ';';
+    }
+
+    return lines;
+}
+
+constexpr size_t staticTargets(const char* script) {
+    size_t targets = 1;
+
+    for (; *script; script++) {
+        targets += *script == ',';
+    }
+
+    return targets;
+}
+
+/**
+ * Length of the longest key or value in script without surrounding white space, they must fit in
+ * SCRIPTRUNNER_STRING_BUFFER to be copied out of program memory
+ */
+constexpr size_t staticLongest(const char* script) {
+    size_t longest = 0;
+
+    while (*script) {
+        const char* keyEnd = script;
+
+        while (*keyEnd && *keyEnd != ';' && *keyEnd != '=') {
+            keyEnd++;
+        }
+
+        // The value runs to the end of the line, further = are part of it
+        const char* valueEnd = keyEnd;
+
+        while (*valueEnd && *valueEnd != ';') {
+            valueEnd++;
+        }
+
+        size_t key = detail::trimmedLength(script, keyEnd);
+        size_t value = *keyEnd == '=' ? detail::trimmedLength(keyEnd + 1, valueEnd) : 0;
+        longest = key > longest ? key : longest;
+        longest = value > longest ? value : longest;
+        script = *valueEnd ? valueEnd + 1 : valueEnd;
+    }
+
+    return longest;
+}
+
+/**
+ * Parse script at compile time the way BasicProgram does at runtime. Jumps, calls, loops, switches and
+ * register operands are resolved, lines that don't parse are left to the commands like the interpreter does.
+ * Labels stay as lines so line numbers match the text, jumps go to the line after a label.
+ * Longest is the length of the longest key or value, see staticLongest()
+ */
+template<size_t Lines, size_t Targets, size_t Longest, size_t Size>
+constexpr StaticProgram<Lines, Size, Targets> parseStatic(const char (&script)[Size]) {
+    static_assert(Longest < SCRIPTRUNNER_STRING_BUFFER, "keys and values must fit in SCRIPTRUNNER_STRING_BUFFER");
+    StaticProgram<Lines, Size, Targets> program;
+    size_t targets = 0;
+
+    for (size_t i = 0; i < Size; i++) {
+        program.m_text[i] = script[i];
+    }
+
+    // Split into key=value lines, surrounding white space is removed and empty lines are skipped
+    for (size_t start = 0; start < Size - 1;) {
+        size_t end = start;
+
+        while (end < Size - 1 && program.m_text[end] != ';') {
+            end++;
+        }
+
+        size_t key = start;
+        size_t keyEnd = start;
+
+        while (keyEnd < end && program.m_text[keyEnd] != '=') {
+            keyEnd++;
+        }
+
+        size_t value = keyEnd < end ? keyEnd + 1 : keyEnd;
+        size_t valueEnd = end;
+
+        while (key < keyEnd && detail::isSpace(program.m_text[key])) {
+            key++;
+        }
+
+        while (value < valueEnd && detail::isSpace(program.m_text[value])) {
+            value++;
+        }
+
+        bool empty = key == keyEnd && value == valueEnd;
+
+        while (keyEnd > key && detail::isSpace(program.m_text[keyEnd - 1])) {
+            keyEnd--;
+        }
+
+        while (valueEnd > value && detail::isSpace(program.m_text[valueEnd - 1])) {
+            valueEnd--;
+        }
+
+        program.m_text[keyEnd] = '\0';
+        program.m_text[valueEnd] = '\0';
+
+        if (!empty) {
+            StaticLine& line = program.m_lines[program.m_size++];
+            line.m_key = key;
+            // Without = the value is the empty string at the end of the key
+            line.m_value = value < valueEnd ? value : keyEnd;
+
+            for (SymbolId id = SymbolTable::END; id <= SymbolTable::LAST_INSTRUCTION; id++) {
+                if (detail::equals(program.string(line.m_key), detail::s_builtins[id])) {
+                    line.m_opcode = static_cast<Opcode>(id);
+                    line.m_symbol = id;
+                }
+            }
+        }
+
+        start = end + 1;
+    }
+
+    StaticLine& last = program.m_lines[program.m_size++];
+    last.m_opcode = Opcode::END;
+    last.m_symbol = SymbolTable::END;
+    last.m_key = Size - 1;
+    last.m_value = Size - 1;
+
+    for (size_t i = 0; i < program.m_size; i++) {
+        if (program.m_lines[i].m_opcode == Opcode::LABEL) {
+            size_t existing = 0;
+
+            if (!detail::findLabel(program, program.string(program.m_lines[i].m_value), existing)) {
+                program.m_labelNames[program.m_labelCount] = program.m_lines[i].m_value;
+                program.m_labelLines[program.m_labelCount++] = i;
+            }
+        }
+    }
+
+    size_t open[Lines] = {};
+    size_t depth = 0;
+
+    for (size_t i = 0; i < program.m_size; i++) {
+        StaticLine& line = program.m_lines[i];
+        const char* value = program.string(line.m_value);
+        size_t target = 0;
+
+        switch (line.m_opcode) {
+            case Opcode::JUMP:
+            case Opcode::CALL:
+                // Unknown labels stay, the context stays on the line like the interpreter
+                if (detail::findLabel(program, value, target)) {
+                    line.m_opcode = line.m_opcode == Opcode::JUMP ? Opcode::GOTO : Opcode::GOSUB;
+                    line.m_target = target;
+                }
+
+                break;
+
+            case Opcode::JEQ:
+            case Opcode::JNE:
+            case Opcode::JLT:
+            case Opcode::JLE:
+            case Opcode::JGT:
+            case Opcode::JGE:
+            case Opcode::JTRUE:
+            case Opcode::JFALSE:
+                if (detail::findLabel(program, value, target)) {
+                    line.m_opcode = Opcode::BRANCH;
+                    line.m_target = target;
+                } else {
+                    line.m_opcode = Opcode::COMMAND;
+                }
+
+                break;
+
+            case Opcode::WAIT:
+                line.m_count = detail::leadingInteger(value);
+                break;
+
+            case Opcode::SET:
+            case Opcode::ADD:
+            case Opcode::CMP: {
+                const char* text = value;
+                bool valid = detail::registerIndex(text, line.m_register) && *text++ == ',';
+                const char* source = text;
+
+                if (valid && detail::registerIndex(source, line.m_source) && *source == '\0') {
+                    break;
+                }
+
+                line.m_source = ScriptOperands::NO_REGISTER;
+
+                if (!valid || !detail::integer(text, line.m_immediate)) {
+                    line.m_opcode = Opcode::COMMAND;
+                }
+
+                break;
+            }
+
+            case Opcode::SWITCH: {
+                const char* text = value;
+                bool valid = detail::registerIndex(text, line.m_register) && *text == ',';
+                line.m_target = targets;
+
+                while (valid && *text == ',') {
+                    const char* name = ++text;
+
+                    while (*text && *text != ',') {
+                        text++;
+                    }
+
+                    valid = detail::findLabel(program, name, text - name, target);
+
+                    if (valid) {
+                        program.m_targets[targets++] = target;
+                        line.m_count++;
+                    }
+                }
+
+                if (!valid) {
+                    targets = line.m_target;
+                    line.m_count = 0;
+                    line.m_opcode = Opcode::COMMAND;
+                }
+
+                break;
+            }
+
+            case Opcode::REPEAT: {
+                uint32_t count = 0;
+                detail::number(value, count);
+                line.m_count = count;
+                line.m_loop = program.m_loops++;
+                open[depth++] = i;
+                break;
+            }
+
+            case Opcode::ENDREPEAT: {
+                if (depth == 0) {
+                    // Without repeat it does nothing
+                    line.m_opcode = Opcode::LABEL;
+                    break;
+                }
+
+                StaticLine& repeat = program.m_lines[open[--depth]];
+                line.m_loop = repeat.m_loop;
+                line.m_target = open[depth] + 1;
+
+                if (repeat.m_count == 0) {
+                    repeat.m_opcode = Opcode::GOTO;
+                    repeat.m_target = i + 1;
+                }
+
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        // Commands get their SymbolId when the program is attached to a context
+        if (line.m_opcode == Opcode::COMMAND) {
+            line.m_symbol = SymbolTable::NOT_FOUND;
+        }
+    }
+
+    return program;
+}
+
+/**
+ * Parse a string literal at compile time, use it to initialise a static constexpr program
+ *
+ *   static constexpr auto brew = SCRIPTRUNNER_STATIC_SCRIPT("pump=on;wait=25000;pump=off;");
+ *   Context context;
+ *   runStatic<brew>(context);
+ */
+#define SCRIPTRUNNER_STATIC_SCRIPT(script) \
+    ::rvt::scriptrunner::parseStatic<::rvt::scriptrunner::staticLines(script), \
+    ::rvt::scriptrunner::staticTargets(script), ::rvt::scriptrunner::staticLongest(script)>(script)
+
+namespace detail {
+
+/**
+ * Runtime part of a StaticProgram, the SymbolId's of it's commands
+ */
+template<const auto& Program>
+struct StaticRuntime {
+    static inline SymbolId s_symbols[sizeof(Program.m_lines) / sizeof(StaticLine)] = {};
+
+    template<typename Memory>
+    static void intern() {
+        char key[SCRIPTRUNNER_STRING_BUFFER];
+        constexpr size_t size = Program.size();
+
+        for (size_t i = 0; i < size; i++) {
+            const StaticLine line = readMemory<Memory>(&Program.m_lines[i]);
+            s_symbols[i] = line.m_opcode == Opcode::COMMAND ?
+                           SymbolTable::instance().intern(Memory::string(Program.string(line.m_key), key, sizeof(key))) :
+                           line.m_symbol;
+        }
+    }
+};
+
+}
+
+/**
+ * Line to continue with for the label name of Program, for context.jump()
+ */
+template<const auto& Program, typename Memory>
+bool staticLabel(const char* name, ScriptOffset& line) {
+    char label[SCRIPTRUNNER_STRING_BUFFER];
+    constexpr size_t count = Program.m_labelCount;
+
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(Memory::string(Program.string(readMemory<Memory>(&Program.m_labelNames[i])), label, sizeof(label)),
+                   name) == 0) {
+            // Labels are not run, like jumps we go to the line after it
+            line = readMemory<Memory>(&Program.m_labelLines[i]) + 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * One tick of a StaticProgram, does what handle() does for the line the context is on.
+ * Program is only read through Memory
+ */
+template<const auto& Program, typename Memory, typename Allocator>
+bool staticStep(BasicContext<Allocator>& context, const typename BasicContext<Allocator>::CommandDispatcher& commands) {
+    ScriptOffset index = context.lineNumber();
+    const StaticLine line = readMemory<Memory>(&Program.m_lines[index]);
+    ScriptOffset next = index + 1;
+    int32_t value = line.m_source == ScriptOperands::NO_REGISTER ? line.m_immediate : context.registerValue(line.m_source);
+
+    switch (line.m_opcode) {
+        case Opcode::END:
+            return false;
+
+        case Opcode::GOTO:
+            return context.stepTo(line.m_target);
+
+        case Opcode::GOSUB:
+            return context.stepCall(line.m_target, next);
+
+        case Opcode::RETURN:
+            return context.stepReturn();
+
+        case Opcode::JUMP:
+        case Opcode::CALL:
+            return true;
+
+        case Opcode::WAIT:
+            return context.stepWait(line.m_count, next);
+
+        case Opcode::SET:
+            context.setRegister(line.m_register, value);
+            return context.stepTo(next);
+
+        case Opcode::ADD:
+            context.setRegister(line.m_register, static_cast<int32_t>(static_cast<uint32_t>(context.registerValue(
+                                    line.m_register)) + static_cast<uint32_t>(value)));
+            return context.stepTo(next);
+
+        case Opcode::CMP:
+            return context.stepCompare(context.registerValue(line.m_register), value, next);
+
+        case Opcode::BRANCH:
+            return context.stepTo(context.condition(line.m_symbol) ? line.m_target : next);
+
+        case Opcode::SWITCH: {
+            uint32_t selected = context.registerValue(line.m_register);
+            return context.stepTo(selected < line.m_count ?
+                                  readMemory<Memory>(&Program.m_targets[line.m_target + selected]) : next);
+        }
+
+        case Opcode::REPEAT:
+            return context.stepRepeat(line.m_loop, line.m_count, next);
+
+        case Opcode::ENDREPEAT:
+            return context.stepEndRepeat(line.m_loop, line.m_target, next);
+
+        case Opcode::COMMAND: {
+            // Only valid while the commands run, like the line of an interpreted script
+            char key[SCRIPTRUNNER_STRING_BUFFER];
+            char text[SCRIPTRUNNER_STRING_BUFFER];
+            OptValue current(index, Memory::string(Program.string(line.m_key), key, sizeof(key)),
+                             Memory::string(Program.string(line.m_value), text, sizeof(text)));
+            return commands.command(context, detail::StaticRuntime<Program>::s_symbols[index], current, next);
+        }
+
+        default:
+            return context.stepTo(next);
+    }
+}
+
+/**
+ * Make context run Program, a StaticProgram with static storage. The lines are used where they are and only read
+ * through Memory, so a program declared with PROGMEM runs from flash with ProgmemMemory:
+ *
+ *   static constexpr auto brew PROGMEM = SCRIPTRUNNER_STATIC_SCRIPT("pump=on;wait=25000;pump=off;");
+ *   runStatic<brew, ProgmemMemory>(context);
+ *
+ * The context should be created without a script
+ */
+template<const auto& Program, typename Memory = DirectMemory, typename Allocator>
+void runStatic(BasicContext<Allocator>& context) {
+    detail::StaticRuntime<Program>::template intern<Memory>();
+    constexpr size_t loops = Program.loops();
+    constexpr size_t labels = Program.m_labelCount;
+    context.setCompiledScript(&staticStep<Program, Memory, Allocator>, loops,
+                              labels == 0 ? nullptr : &staticLabel<Program, Memory>);
+}
+
+}
+}
+
+#endif
@@ -0,0 +1,284 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+
+namespace rvt {
+
+namespace scriptrunner {
+
+typedef uint16_t SymbolId;
+
+/**
+ * Interned names of commands, built-in instructions and labels.
+ * Names are given an id when scripts are loaded and commands are created, at runtime only ids are compared.
+ * Each name is stored once for all scripts.
+ * The table is shared by everything in the process. Interning is serialised and only done at load time, so a
+ * script can be loaded while runners on other threads look names up. Lookups don't lock or allocate, a name is
+ * found through a hash index and an id is mapped to it's name in constant time
+ */
+class SymbolTable {
+    enum : size_t {
+        BLOCK_SIZE = 32,
+        // Block 0 and 1 hold BLOCK_SIZE names, every next block twice as many, enough for all ids below NOT_FOUND
+        BLOCK_COUNT = 12,
+        INDEX_SIZE = 64
+    };
+
+    // Open addressing hash index from name to id, it's replaced by one twice the size when half full.
+    // A lookup may still be reading a replaced index, so those are only freed with the table
+    struct Index {
+        size_t m_mask;
+        std::atomic<SymbolId>* m_slots;
+        Index* m_replaced;
+
+        Index(size_t p_size, Index* p_replaced) :
+            m_mask(p_size - 1),
+            m_slots(new std::atomic<SymbolId>[p_size]),
+            m_replaced(p_replaced) {
+            for (size_t i = 0; i < p_size; i++) {
+                m_slots[i].store(NOT_FOUND, std::memory_order_relaxed);
+            }
+        }
+
+        ~Index() {
+            delete[] m_slots;
+        }
+    };
+
+    // Blocks never move, so a lookup is not disturbed by a name that is added
+    const char* m_first[BLOCK_SIZE];
+    std::atomic<const char**> m_blocks[BLOCK_COUNT];
+    std::atomic<Index*> m_index;
+    // Published after the name it counts is stored, lookups only read names below it
+    std::atomic<size_t> m_size;
+    std::atomic<bool> m_interning;
+
+    static size_t blockOf(size_t id) {
+        size_t block = 0;
+
+        for (size_t rest = id / BLOCK_SIZE; rest != 0; rest >>= 1) {
+            block++;
+        }
+
+        return block;
+    }
+
+    static size_t blockStart(size_t block) {
+        return block == 0 ? 0 : BLOCK_SIZE << (block - 1);
+    }
+
+    const char*& slot(size_t id) const {
+        size_t block = blockOf(id);
+        return m_blocks[block].load(std::memory_order_acquire)[id - blockStart(block)];
+    }
+
+    SymbolId find(const char* name, size_t length, uint32_t hashed) const {
+        const Index* index = m_index.load(std::memory_order_acquire);
+
+        for (size_t i = hashed & index->m_mask;; i = (i + 1) & index->m_mask) {
+            SymbolId id = index->m_slots[i].load(std::memory_order_acquire);
+
+            if (id == NOT_FOUND) {
+                return NOT_FOUND;
+            }
+
+            const char* candidate = slot(id);
+
+            if (strncmp(candidate, name, length) == 0 && candidate[length] == '\0') {
+                return id;
+            }
+        }
+    }
+
+    static void insert(Index& index, SymbolId id, uint32_t hashed) {
+        size_t i = hashed & index.m_mask;
+
+        while (index.m_slots[i].load(std::memory_order_relaxed) != NOT_FOUND) {
+            i = (i + 1) & index.m_mask;
+        }
+
+        index.m_slots[i].store(id, std::memory_order_release);
+    }
+
+    SymbolTable() : m_index(new Index(INDEX_SIZE, nullptr)), m_size(0), m_interning(false) {
+        m_blocks[0].store(m_first, std::memory_order_relaxed);
+
+        for (size_t block = 1; block < BLOCK_COUNT; block++) {
+            m_blocks[block].store(nullptr, std::memory_order_relaxed);
+        }
+
+        // Fixed ids for the built-in instructions, these match the Opcode values
+        intern("");
+        intern("end");
+        intern("jump");
+        intern("wait");
+        intern("label");
+        intern("repeat");
+        intern("endrepeat");
+        intern("call");
+        intern("return");
+        intern("set");
+        intern("add");
+        intern("cmp");
+        intern("jeq");
+        intern("jne");
+        intern("jlt");
+        intern("jle");
+        intern("jgt");
+        intern("jge");
+        intern("jtrue");
+        intern("jfalse");
+        intern("switch");
+        intern("include");
+    }
+
+    ~SymbolTable() {
+        for (size_t id = 0; id < size(); id++) {
+            delete[] name(id);
+        }
+
+        for (size_t block = 1; block < BLOCK_COUNT; block++) {
+            delete[] m_blocks[block].load();
+        }
+
+        for (Index* index = m_index.load(); index != nullptr;) {
+            Index* replaced = index->m_replaced;
+            delete index;
+            index = replaced;
+        }
+    }
+
+public:
+    enum : SymbolId {
+        EMPTY = 0,
+        END = 1,
+        JUMP = 2,
+        WAIT = 3,
+        LABEL = 4,
+        REPEAT = 5,
+        ENDREPEAT = 6,
+        CALL = 7,
+        RETURN = 8,
+        SET = 9,
+        ADD = 10,
+        CMP = 11,
+        JEQ = 12,
+        JNE = 13,
+        JLT = 14,
+        JLE = 15,
+        JGT = 16,
+        JGE = 17,
+        JTRUE = 18,
+        JFALSE = 19,
+        SWITCH = 20,
+        // Highest id of a built-in instruction
+        LAST_INSTRUCTION = SWITCH,
+        // Load time directive, replaced by the lines of a module
+        INCLUDE = 21,
+        NOT_FOUND = 0xffff
+    };
+
+    SymbolTable(const SymbolTable&) = delete;
+    SymbolTable& operator=(const SymbolTable&) = delete;
+
+    static SymbolTable& instance() {
+        static SymbolTable s_table;
+        return s_table;
+    }
+
+    /**
+     * FNV-1a hash of the first length characters of name
+     */
+    static uint32_t hash(const char* name, size_t length) {
+        uint32_t hash = 2166136261u;
+
+        for (size_t i = 0; i < length; i++) {
+            hash = (hash ^ static_cast<uint8_t>(name[i])) * 16777619u;
+        }
+
+        return hash;
+    }
+
+    /**
+     * Id of name, or NOT_FOUND when the name was never interned
+     */
+    SymbolId find(const char* name) const {
+        size_t length = strlen(name);
+        return find(name, length, hash(name, length));
+    }
+
+    /**
+     * Id of the first length characters of name, for names that are not terminated
+     */
+    SymbolId find(const char* name, size_t length) const {
+        return find(name, length, hash(name, length));
+    }
+
+    /**
+     * Id of name, the name is added to the table when not yet known.
+     * NOT_FOUND when the table is full, that id is never handed out
+     */
+    SymbolId intern(const char* name) {
+        size_t length = strlen(name);
+        uint32_t hashed = hash(name, length);
+        SymbolId id = find(name, length, hashed);
+
+        if (id != NOT_FOUND) {
+            return id;
+        }
+
+        // Rare and short, a spin lock works on every platform
+        while (m_interning.exchange(true, std::memory_order_acquire)) {
+        }
+
+        // Another thread may have added it meanwhile
+        id = find(name, length, hashed);
+        size_t size = m_size.load(std::memory_order_relaxed);
+
+        if (id == NOT_FOUND && size != NOT_FOUND) {
+            size_t block = blockOf(size);
+
+            if (size == blockStart(block) && block != 0) {
+                m_blocks[block].store(new const char*[blockStart(block)], std::memory_order_release);
+            }
+
+            char* copy = new char[length + 1];
+            memcpy(copy, name, length + 1);
+            slot(size) = copy;
+            id = size;
+
+            Index* index = m_index.load(std::memory_order_relaxed);
+
+            if ((size + 1) * 2 > index->m_mask + 1) {
+                Index* grown = new Index((index->m_mask + 1) * 2, index);
+
+                for (size_t known = 0; known < size; known++) {
+                    const char* knownName = slot(known);
+                    insert(*grown, known, hash(knownName, strlen(knownName)));
+                }
+
+                index = grown;
+            }
+
+            insert(*index, id, hashed);
+            m_index.store(index, std::memory_order_release);
+            m_size.store(size + 1, std::memory_order_release);
+        }
+
+        m_interning.store(false, std::memory_order_release);
+        return id;
+    }
+
+    const char* name(SymbolId id) const {
+        return slot(id);
+    }
+
+    size_t size() const {
+        return m_size.load(std::memory_order_acquire);
+    }
+};
+
+}
+}
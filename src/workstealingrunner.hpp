@@ -0,0 +1,286 @@
+#pragma once
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "scriptrunner.hpp"
+
+namespace rvt {
+
+namespace scriptrunner {
+
+/**
+ * Runs many contexts on a pool of threads, intended for host side simulations
+ * Each worker has it's own queue of contexts, it handles one line of the context at the front and
+ * puts it back at the end. Workers that run out of contexts steal from the back of the others.
+ * A context is owned by exactly one worker between taking it and putting it back, so it is never
+ * handled by two threads at once. See Command for the threading contract of commands.
+ * Sleeping contexts and contexts that wait for an event with a timeout go on a timer heap of their worker, contexts
+ * that wait without timeout are parked until signal(). A worker without work blocks until it's first timer expires.
+ * Contexts are not owned by the runner and must stay alive until they finished or the runner is destroyed
+ */
+template<typename ContextType, typename Allocator = std::allocator<char>>
+class WorkStealingRunner {
+    struct Worker {
+        std::mutex m_mutex;
+        std::deque<ContextType*> m_queue;
+        // Ordered by wake up time, the first to wake up is at the front
+        std::vector<ContextType*> m_timers;
+        std::thread m_thread;
+    };
+
+    const ScriptRunner<ContextType, Allocator>& m_runner;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<size_t> m_nextWorker;
+    std::atomic<size_t> m_running;
+    // Contexts in the queues, idle workers wait for this to become non zero
+    std::atomic<size_t> m_queued;
+    std::atomic<size_t> m_idleWorkers;
+    std::atomic<bool> m_stop;
+    std::mutex m_idleMutex;
+    std::condition_variable m_idle;
+    // Separate from m_idle, so a wake up meant for a worker never goes to a thread in wait()
+    std::condition_variable m_done;
+    // Contexts waiting for an event without timeout
+    std::mutex m_parkedMutex;
+    std::vector<ContextType*> m_parked;
+
+    static bool later(const ContextType* first, const ContextType* second) {
+        return static_cast<int32_t>(first->wakeAt() - second->wakeAt()) > 0;
+    }
+
+    ContextType* take(size_t self) {
+        {
+            Worker& worker = *m_workers[self];
+            std::lock_guard<std::mutex> lock(worker.m_mutex);
+
+            if (!worker.m_queue.empty()) {
+                ContextType* context = worker.m_queue.front();
+                worker.m_queue.pop_front();
+                m_queued--;
+                return context;
+            }
+        }
+
+        for (size_t i = 1; i < m_workers.size(); i++) {
+            Worker& victim = *m_workers[(self + i) % m_workers.size()];
+            std::lock_guard<std::mutex> lock(victim.m_mutex);
+
+            if (!victim.m_queue.empty()) {
+                ContextType* context = victim.m_queue.back();
+                victim.m_queue.pop_back();
+                m_queued--;
+                return context;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void put(size_t worker, ContextType* context) {
+        {
+            Worker& target = *m_workers[worker];
+            std::lock_guard<std::mutex> lock(target.m_mutex);
+            target.m_queue.push_back(context);
+            m_queued++;
+        }
+
+        // Only pay for the wake up when a worker sleeps, it checks m_queued under m_idleMutex before it does
+        if (m_idleWorkers != 0) {
+            std::lock_guard<std::mutex> lock(m_idleMutex);
+            m_idle.notify_one();
+        }
+    }
+
+    void addTimer(size_t self, ContextType* context) {
+        Worker& worker = *m_workers[self];
+        std::lock_guard<std::mutex> lock(worker.m_mutex);
+        worker.m_timers.push_back(context);
+        std::push_heap(worker.m_timers.begin(), worker.m_timers.end(), later);
+    }
+
+    void park(ContextType* context) {
+        std::lock_guard<std::mutex> lock(m_parkedMutex);
+        m_parked.push_back(context);
+    }
+
+    /**
+     * Move the expired timers of worker self to it's queue, returns the milli seconds till the next one or -1 when
+     * there are none
+     */
+    int64_t expireTimers(size_t self) {
+        Worker& worker = *m_workers[self];
+        std::lock_guard<std::mutex> lock(worker.m_mutex);
+        uint32_t now = millis();
+
+        while (!worker.m_timers.empty()) {
+            ContextType* first = worker.m_timers.front();
+            int32_t left = static_cast<int32_t>(first->wakeAt() - now);
+
+            if (left > 0) {
+                return left;
+            }
+
+            std::pop_heap(worker.m_timers.begin(), worker.m_timers.end(), later);
+            worker.m_timers.pop_back();
+            worker.m_queue.push_back(first);
+            m_queued++;
+        }
+
+        return -1;
+    }
+
+    void sleep(int64_t millisToWait) {
+        std::unique_lock<std::mutex> lock(m_idleMutex);
+        m_idleWorkers++;
+        auto ready = [this]() {
+            return m_stop || m_queued != 0;
+        };
+
+        if (millisToWait < 0) {
+            m_idle.wait(lock, ready);
+        } else {
+            m_idle.wait_for(lock, std::chrono::milliseconds(millisToWait), ready);
+        }
+
+        m_idleWorkers--;
+    }
+
+    void finished() {
+        if (--m_running == 0) {
+            std::lock_guard<std::mutex> lock(m_idleMutex);
+            m_done.notify_all();
+        }
+    }
+
+    void run(size_t self) {
+        while (!m_stop) {
+            int64_t nextTimer = expireTimers(self);
+            ContextType* context = take(self);
+
+            if (context == nullptr) {
+                sleep(nextTimer);
+                continue;
+            }
+
+            if (!m_runner.handle(*context)) {
+                finished();
+            } else if (context->hasTimer()) {
+                addTimer(self, context);
+            } else if (context->waitingForEvent()) {
+                park(context);
+            } else {
+                put(self, context);
+            }
+        }
+    }
+
+public:
+    WorkStealingRunner(const ScriptRunner<ContextType, Allocator>& p_runner,
+                       size_t p_threads = std::thread::hardware_concurrency()) :
+        m_runner(p_runner),
+        m_nextWorker(0),
+        m_running(0),
+        m_queued(0),
+        m_idleWorkers(0),
+        m_stop(false) {
+        if (p_threads == 0) {
+            p_threads = 1;
+        }
+
+        for (size_t i = 0; i < p_threads; i++) {
+            m_workers.push_back(std::unique_ptr<Worker>(new Worker()));
+        }
+
+        for (size_t i = 0; i < p_threads; i++) {
+            m_workers[i]->m_thread = std::thread(&WorkStealingRunner::run, this, i);
+        }
+    }
+
+    WorkStealingRunner(const WorkStealingRunner&) = delete;
+    WorkStealingRunner& operator=(const WorkStealingRunner&) = delete;
+
+    ~WorkStealingRunner() {
+        {
+            std::lock_guard<std::mutex> lock(m_idleMutex);
+            m_stop = true;
+            m_idle.notify_all();
+        }
+
+        for (auto& worker : m_workers) {
+            worker->m_thread.join();
+        }
+    }
+
+    /**
+     * Start running context, contexts are handed to the workers round robin
+     */
+    void start(ContextType* context) {
+        m_running++;
+        put(m_nextWorker++ % m_workers.size(), context);
+    }
+
+    /**
+     * Wake the contexts that wait for event, parked ones and ones with a timeout. Can be called from any thread.
+     * Like with ScriptRunner signals are not remembered, a context that is being handled while the signal
+     * arrives and only then starts waiting will not see it
+     */
+    void signal(SymbolId event) {
+        std::vector<ContextType*> woken;
+
+        {
+            std::lock_guard<std::mutex> lock(m_parkedMutex);
+
+            for (auto it = m_parked.begin(); it != m_parked.end();) {
+                if ((*it)->signal(event)) {
+                    woken.push_back(*it);
+                    it = m_parked.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        for (auto& worker : m_workers) {
+            std::lock_guard<std::mutex> lock(worker->m_mutex);
+            auto timers = std::partition(worker->m_timers.begin(), worker->m_timers.end(), [event](ContextType * context) {
+                return !context->signal(event);
+            });
+            woken.insert(woken.end(), timers, worker->m_timers.end());
+            worker->m_timers.erase(timers, worker->m_timers.end());
+            std::make_heap(worker->m_timers.begin(), worker->m_timers.end(), later);
+        }
+
+        for (auto context : woken) {
+            put(m_nextWorker++ % m_workers.size(), context);
+        }
+    }
+
+    /**
+     * Block until all started contexts have reached their end
+     */
+    void wait() {
+        std::unique_lock<std::mutex> lock(m_idleMutex);
+        m_done.wait(lock, [this]() {
+            return m_running == 0;
+        });
+    }
+
+    size_t running() const {
+        return m_running;
+    }
+
+    size_t threads() const {
+        return m_workers.size();
+    }
+};
+
+}
+}
@@ -0,0 +1,9 @@
+// Allocation counting test runner
+// Replaces the global allocation functions so tests can assert that the
+// steady state of the scriptrunner does not touch the heap
+
+#define CATCH_CONFIG_MAIN
+
+#include "catch2/catch.hpp"
+#include "src/allocationcounter.hpp"
+#include "src/test_allocations.hpp"
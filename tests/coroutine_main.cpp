@@ -0,0 +1,6 @@
+// Tests for the optional C++20 coroutine commands
+
+#define CATCH_CONFIG_MAIN
+
+#include "catch2/catch.hpp"
+#include "src/test_coroutinecommand.hpp"
@@ -5,3 +5,11 @@
 
 #include "catch2/catch.hpp"
 #include "src/test_scriptrunner.hpp"
+#include "src/test_contextpool.hpp"
+#include "src/test_scriptprogram.hpp"
+#include "src/test_workstealingrunner.hpp"
+#include "src/test_shardedrunner.hpp"
+#include "src/test_codegenerator.hpp"
+#ifdef __linux__
+#include "src/test_directoryrunner.hpp"
+#endif
@@ -0,0 +1,103 @@
+#pragma once
+#include <stdlib.h>
+#include <stddef.h>
+#include <new>
+
+/**
+ * Counts heap allocations made while armed.
+ * When the build links with -Wl,--wrap=malloc (ALLOCATION_COUNTER_WRAP_MALLOC) malloc, calloc
+ * and realloc are counted as well, otherwise only operator new is seen.
+ */
+struct AllocationCounter {
+    static bool& armed() {
+        static bool s_armed = false;
+        return s_armed;
+    }
+
+    static size_t& count() {
+        static size_t s_count = 0;
+        return s_count;
+    }
+
+    static void record() {
+        if (armed()) {
+            count()++;
+        }
+    }
+
+    static void start() {
+        count() = 0;
+        armed() = true;
+    }
+
+    static size_t stop() {
+        armed() = false;
+        return count();
+    }
+};
+
+#ifdef ALLOCATION_COUNTER_WRAP_MALLOC
+extern "C" {
+    void* __real_malloc(size_t size);
+    void* __real_calloc(size_t num, size_t size);
+    void* __real_realloc(void* ptr, size_t size);
+
+    void* __wrap_malloc(size_t size) {
+        AllocationCounter::record();
+        return __real_malloc(size);
+    }
+
+    void* __wrap_calloc(size_t num, size_t size) {
+        AllocationCounter::record();
+        return __real_calloc(num, size);
+    }
+
+    void* __wrap_realloc(void* ptr, size_t size) {
+        AllocationCounter::record();
+        return __real_realloc(ptr, size);
+    }
+}
+#define ALLOCATION_COUNTER_MALLOC(size) __real_malloc(size)
+#else
+#define ALLOCATION_COUNTER_MALLOC(size) malloc(size)
+#endif
+
+void* operator new (size_t size) {
+    AllocationCounter::record();
+    void* ptr = ALLOCATION_COUNTER_MALLOC(size == 0 ? 1 : size);
+
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    return operator new (size);
+}
+
+void* operator new (size_t size, const std::nothrow_t&) noexcept {
+    AllocationCounter::record();
+    return ALLOCATION_COUNTER_MALLOC(size == 0 ? 1 : size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+    return operator new (size, tag);
+}
+
+void operator delete (void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete (void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    free(ptr);
+}
@@ -1,10 +1,16 @@
 
 #include <stdint.h>
+#include <atomic>
 
 #ifndef MILLISSTUBBED
 #define MILLISSTUBBED
-uint32_t millisStubbed = 0;
+// Atomic as the threaded runner tests advance time while the shards read it
+std::atomic<uint32_t> millisStubbed{0};
 extern "C" uint32_t millis() {
     return millisStubbed;
 };
+uint32_t microsStubbed = 0;
+extern "C" uint32_t micros() {
+    return microsStubbed;
+};
 #endif
@@ -0,0 +1,154 @@
+/**
+ * Generated from script recipe, do not edit
+ */
+#pragma once
+#include <scriptrunner.hpp>
+
+/**
+ * SymbolId's of the commands of recipe, resolved by recipe(context)
+ */
+inline rvt::scriptrunner::SymbolId* recipeSymbols() {
+    static rvt::scriptrunner::SymbolId s_symbols[3] = {};
+    return s_symbols;
+}
+
+template<typename Allocator>
+bool recipeStep(rvt::scriptrunner::BasicContext<Allocator>& context,
+        const typename rvt::scriptrunner::BasicContext<Allocator>::CommandDispatcher& commands) {
+    using namespace rvt::scriptrunner;
+
+    switch (context.lineNumber()) {
+        case 0:
+            context.setRegister(0, 3);
+            return context.stepTo(1);
+
+        case 1: {
+            static const OptValue line(1, "trace", ".");
+            return commands.command(context, recipeSymbols()[0], line, 2);
+        }
+
+        case 2:
+            return context.stepWait(10UL, 3);
+
+        case 3:
+            context.setRegister(0, static_cast<int32_t>(static_cast<uint32_t>(context.registerValue(0)) + static_cast<uint32_t>(-1)));
+            return context.stepTo(4);
+
+        case 4:
+            return context.stepCompare(context.registerValue(0), 0, 5);
+
+        case 5:
+            return context.stepTo(context.condition(SymbolTable::JGT) ? 1 : 6);
+
+        case 6:
+            return context.stepRepeat(0, 2, 7);
+
+        case 7: {
+            static const OptValue line(7, "trace", "r");
+            return commands.command(context, recipeSymbols()[0], line, 8);
+        }
+
+        case 8:
+            return context.stepEndRepeat(0, 7, 9);
+
+        case 9: {
+            static const OptValue line(9, "goto", "after");
+            return commands.command(context, recipeSymbols()[1], line, 10);
+        }
+
+        case 10: {
+            static const OptValue line(10, "trace", "never");
+            return commands.command(context, recipeSymbols()[0], line, 11);
+        }
+
+        case 11: {
+            static const OptValue line(11, "select", "1");
+            return commands.command(context, recipeSymbols()[2], line, 12);
+        }
+
+        case 12:
+            switch (context.registerValue(1)) {
+                case 0:
+                    return context.stepTo(13);
+
+                case 1:
+                    return context.stepTo(14);
+
+                default:
+                    return context.stepTo(13);
+            }
+
+        case 13: {
+            static const OptValue line(13, "trace", "1");
+            return commands.command(context, recipeSymbols()[0], line, 14);
+        }
+
+        case 14:
+            return context.stepCall(17, 15);
+
+        case 15: {
+            static const OptValue line(15, "trace", "done");
+            return commands.command(context, recipeSymbols()[0], line, 16);
+        }
+
+        case 16:
+            return false;
+
+        case 17: {
+            static const OptValue line(17, "trace", "s");
+            return commands.command(context, recipeSymbols()[0], line, 18);
+        }
+
+        case 18:
+            return context.stepReturn();
+
+        case 19:
+            return false;
+
+        default:
+            return false;
+    }
+}
+
+inline bool recipeLabel(const char* name, rvt::scriptrunner::ScriptOffset& line) {
+    if (strcmp(name, "loop") == 0) {
+        line = 1;
+        return true;
+    }
+
+    if (strcmp(name, "after") == 0) {
+        line = 11;
+        return true;
+    }
+
+    if (strcmp(name, "one") == 0) {
+        line = 13;
+        return true;
+    }
+
+    if (strcmp(name, "two") == 0) {
+        line = 14;
+        return true;
+    }
+
+    if (strcmp(name, "sub") == 0) {
+        line = 17;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Make context run recipe, create the context without a script
+ */
+template<typename Allocator>
+void recipe(rvt::scriptrunner::BasicContext<Allocator>& context) {
+    static const char* const names[] = {"trace", "goto", "select"};
+
+    for (size_t i = 0; i < 3; i++) {
+        recipeSymbols()[i] = rvt::scriptrunner::SymbolTable::instance().intern(names[i]);
+    }
+
+    context.setCompiledScript(&recipeStep<Allocator>, 1, &recipeLabel);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+/**
+ * Script shared by the code generator and static program tests, so they check the same thing.
+ * generated_recipe.hpp is host/scriptcompile -n recipe run on this script, "Should match the generated recipe"
+ * fails when the two drift apart
+ */
+#define RECIPE_SCRIPT \
+    "set=r0,3;" \
+    "label=loop;" \
+    "trace=.;" \
+    "wait=10;" \
+    "add=r0,-1;" \
+    "cmp=r0,0;" \
+    "jgt=loop;" \
+    "repeat=2;" \
+    "trace=r;" \
+    "endrepeat;" \
+    "goto=after;" \
+    "trace=never;" \
+    "label=after;" \
+    "select=1;" \
+    "switch=r1,one,two;" \
+    "label=one;" \
+    "trace=1;" \
+    "label=two;" \
+    "call=sub;" \
+    "trace=done;" \
+    "end;" \
+    "label=sub;" \
+    "trace=s;" \
+    "return;"
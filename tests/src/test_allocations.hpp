@@ -0,0 +1,368 @@
+#include <catch2/catch.hpp>
+
+#include <scriptrunner.hpp>
+#include <contextpool.hpp>
+#include "arduinostubs.hpp"
+#include "allocationcounter.hpp"
+#include "generated_recipe.hpp"
+
+using namespace rvt::scriptrunner;
+
+// Catch may allocate while evaluating assertions, so the counter is
+// stopped before anything is asserted
+
+TEST_CASE("Should not allocate while running built-in instructions", "[allocations]") {
+    class ExtendedContext : public Context {
+    public:
+        uint16_t counter;
+        uint16_t polls;
+        ExtendedContext(const char* script) : Context(script), counter(0), polls(0)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("count", [](const OptValue & value, ExtendedContext & context) {
+        context.counter++;
+        return true;
+    }));
+    commands.push_back(new Command<ExtendedContext>("goto", [](const OptValue & value, ExtendedContext & context) {
+        context.jump(value);
+        return false;
+    }));
+    commands.push_back(new Command<ExtendedContext>("poll", [](const OptValue & value, ExtendedContext & context) {
+        return ++context.polls % 2 == 0;
+    }));
+
+    ExtendedContext context{
+        "label=top;"
+        "count=1;"
+        "repeat=3;"
+        "count=1;"
+        "endrepeat;"
+        "wait=10;"
+        "poll=1;"
+        "jump=middle;"
+        "count=1;"
+        "label=middle;"
+        "goto=top;"};
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+    millisStubbed = 0;
+
+    AllocationCounter::start();
+
+    for (int i = 0; i < 1000; i++) {
+        millisStubbed += 3;
+        scriptRunner.handle(context);
+    }
+
+    size_t allocations = AllocationCounter::stop();
+
+    REQUIRE(context.counter > 10);
+    REQUIRE(allocations == 0);
+}
+
+TEST_CASE("Should not allocate while calling, branching and using registers", "[allocations]") {
+    class ExtendedContext : public Context {
+    public:
+        uint16_t counter;
+        uint16_t doors;
+        ExtendedContext(const char* script) : Context(script), counter(0), doors(0)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("count", [](const OptValue & value, ExtendedContext & context) {
+        context.counter++;
+        return true;
+    }));
+    commands.push_back(new Command<ExtendedContext>("door", [](const OptValue & value, ExtendedContext & context) {
+        context.setCondition(++context.doors % 2 == 0);
+        return true;
+    }));
+
+    ExtendedContext context{
+        "label=top;"
+        "set=r0,3;"
+        "label=loop;"
+        "call=tick;"
+        "add=r0,-1;"
+        "cmp=r0,0;"
+        "jgt=loop;"
+        "door=1;"
+        "jtrue=open;"
+        "jfalse=closed;"
+        "label=open;"
+        "switch=r1,first,second;"
+        "label=first;"
+        "set=r1,1;"
+        "jump=top;"
+        "label=second;"
+        "set=r1,0;"
+        "jump=top;"
+        "label=closed;"
+        "jump=top;"
+        "label=tick;"
+        "count=1;"
+        "return;"};
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+    millisStubbed = 0;
+
+    AllocationCounter::start();
+
+    for (int i = 0; i < 1000; i++) {
+        scriptRunner.handle(context);
+    }
+
+    size_t allocations = AllocationCounter::stop();
+
+    REQUIRE(context.counter > 10);
+    REQUIRE(context.doors > 2);
+    REQUIRE(allocations == 0);
+}
+
+TEST_CASE("Should not allocate while running included modules", "[allocations]") {
+    class ExtendedContext : public Context {
+    public:
+        uint16_t counter;
+        ExtendedContext(const char* script) : Context(script), counter(0)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("count", [](const OptValue & value, ExtendedContext & context) {
+        context.counter++;
+        return true;
+    }));
+
+    ModuleTable::instance().add("pulse", "jump=skip;label=pulse;count=1;return;label=skip;count=1;");
+    ExtendedContext context{"label=top;include=pulse;call=pulse;jump=top;"};
+    ModuleTable::instance().remove("pulse");
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+    millisStubbed = 0;
+
+    AllocationCounter::start();
+
+    for (int i = 0; i < 1000; i++) {
+        scriptRunner.handle(context);
+    }
+
+    size_t allocations = AllocationCounter::stop();
+
+    REQUIRE(context.program().modules() == 1);
+    REQUIRE(context.counter > 10);
+    REQUIRE(allocations == 0);
+}
+
+TEST_CASE("Should not allocate once the script ended", "[allocations]") {
+    std::vector<Command<Context>*> commands;
+    commands.push_back(new Command<Context>("test", [](const OptValue & value, Context & context) {
+        return true;
+    }));
+
+    Context context{
+        "test=1;"
+        "wait=5;"
+        "test=2;"};
+    ScriptRunner<Context> scriptRunner(commands);
+    millisStubbed = 0;
+
+    AllocationCounter::start();
+    bool running = true;
+
+    for (int i = 0; i < 100; i++) {
+        millisStubbed += 1;
+        running = scriptRunner.handle(context);
+    }
+
+    size_t allocations = AllocationCounter::stop();
+
+    REQUIRE(running == false);
+    REQUIRE(allocations == 0);
+}
+
+TEST_CASE("Should not allocate when rerunning a pooled script", "[allocations]") {
+    static const char* script = "test=1;wait=5;test=2;";
+    std::vector<Command<Context>*> commands;
+    commands.push_back(new Command<Context>("test", [](const OptValue & value, Context & context) {
+        return true;
+    }));
+    ScriptRunner<Context> scriptRunner(commands);
+    ContextPool<Context> pool;
+    pool.reserve(script, 1);
+    millisStubbed = 0;
+
+    AllocationCounter::start();
+
+    for (int run = 0; run < 10; run++) {
+        Context* context = pool.acquire(script);
+
+        while (scriptRunner.handle(*context)) {
+            millisStubbed += 1;
+        }
+
+        pool.release(context);
+    }
+
+    size_t allocations = AllocationCounter::stop();
+
+    REQUIRE(pool.size() == 1);
+    REQUIRE(allocations == 0);
+}
+
+TEST_CASE("Should not allocate when running contexts started on the runner", "[allocations]") {
+    std::vector<Command<Context>*> commands;
+    commands.push_back(new Command<Context>("test", [](const OptValue & value, Context & context) {
+        return true;
+    }));
+    ScriptRunner<Context> scriptRunner(commands);
+    size_t finished = 0;
+    scriptRunner.onFinished([&finished](Context & context) {
+        finished++;
+    });
+    Context first{"test=1;wait=5;test=2;"};
+    Context second{"label=top;test=1;jump=top;"};
+    millisStubbed = 0;
+
+    AllocationCounter::start();
+    scriptRunner.start(first);
+    scriptRunner.start(second);
+
+    for (int i = 0; i < 100; i++) {
+        millisStubbed += 1;
+
+        if (i % 2 == 0) {
+            scriptRunner.handle();
+        } else {
+            scriptRunner.handle(4, 100);
+        }
+
+        if (i == 50) {
+            scriptRunner.pause(second);
+        } else if (i == 60) {
+            scriptRunner.resume(second);
+        }
+    }
+
+    scriptRunner.abort(second);
+    bool running = scriptRunner.handle();
+    size_t allocations = AllocationCounter::stop();
+
+    REQUIRE(running == false);
+    REQUIRE(finished == 1);
+    REQUIRE(allocations == 0);
+}
+
+TEST_CASE("Should not allocate when contexts wait for events", "[allocations]") {
+    const SymbolId sensor = SymbolTable::instance().intern("sensor");
+    std::vector<Command<Context>*> commands;
+    commands.push_back(new Command<Context>("waitfor", [](const OptValue & value, Context & context) {
+        return context.waitFor(SymbolTable::instance().find(value), 5);
+    }));
+    ScriptRunner<Context> scriptRunner(commands);
+    Context context{"label=top;waitfor=sensor;waitfor=sensor;jump=top;"};
+    millisStubbed = 0;
+
+    AllocationCounter::start();
+    scriptRunner.start(context);
+
+    for (int i = 0; i < 100; i++) {
+        millisStubbed += 1;
+
+        if (i % 3 == 0) {
+            scriptRunner.postSignal(sensor);
+        }
+
+        scriptRunner.handle();
+    }
+
+    scriptRunner.abort(context);
+    bool running = scriptRunner.handle();
+    size_t allocations = AllocationCounter::stop();
+
+    REQUIRE(running == false);
+    REQUIRE(allocations == 0);
+}
+
+TEST_CASE("Should not allocate when waiting for an event that was never interned", "[allocations]") {
+    std::vector<Command<Context>*> commands;
+    commands.push_back(new Command<Context>("waitfor", [](const OptValue & value, Context & context) {
+        return context.waitFor((const char*)value, 5);
+    }));
+    ScriptRunner<Context> scriptRunner(commands);
+    Context context{"waitfor=nobody signals this;"};
+    millisStubbed = 0;
+
+    AllocationCounter::start();
+    scriptRunner.start(context);
+
+    for (int i = 0; i < 20; i++) {
+        millisStubbed += 1;
+        scriptRunner.handle();
+    }
+
+    bool running = scriptRunner.handle();
+    size_t allocations = AllocationCounter::stop();
+
+    REQUIRE(running == false);
+    REQUIRE(context.eventTimedOut());
+    REQUIRE(SymbolTable::instance().find("nobody signals this") == SymbolTable::NOT_FOUND);
+    REQUIRE(allocations == 0);
+}
+
+TEST_CASE("Should not allocate while running a translated script", "[allocations]") {
+    // None of the commands of the recipe exist, so their names are only interned by recipe()
+    std::vector<Command<Context>*> commands;
+    ScriptRunner<Context> scriptRunner(commands);
+    Context context;
+    recipe(context);
+    millisStubbed = 0;
+
+    AllocationCounter::start();
+    int ticks = 0;
+
+    while (scriptRunner.handle(context) && ticks < 1000) {
+        millisStubbed++;
+        ticks++;
+    }
+
+    size_t allocations = AllocationCounter::stop();
+
+    REQUIRE(ticks < 1000);
+    REQUIRE(allocations == 0);
+}
+
+TEST_CASE("Should not allocate when commands sleep", "[allocations]") {
+    std::vector<Command<Context>*> commands;
+    commands.push_back(new Command<Context>("poll", [](const OptValue & value, Context & context) {
+        return CommandResult::sleepFor(7);
+    }));
+    ScriptRunner<Context> scriptRunner(commands);
+    Context managed{"poll=1;"};
+    Context direct{"poll=1;"};
+    millisStubbed = 0;
+
+    AllocationCounter::start();
+    scriptRunner.start(managed);
+
+    for (int i = 0; i < 100; i++) {
+        millisStubbed += 1;
+        scriptRunner.handle();
+        scriptRunner.handle(direct);
+    }
+
+    scriptRunner.abort(managed);
+    bool running = scriptRunner.handle();
+    size_t allocations = AllocationCounter::stop();
+
+    REQUIRE(running == false);
+    REQUIRE(allocations == 0);
+}
+
+TEST_CASE("Allocation counter should see allocations", "[allocations]") {
+    AllocationCounter::start();
+    Context* context = new Context("test=1;");
+    size_t allocations = AllocationCounter::stop();
+    delete context;
+
+    REQUIRE(allocations > 0);
+}
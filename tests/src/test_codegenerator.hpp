@@ -0,0 +1,99 @@
+#include <catch2/catch.hpp>
+
+#include <scriptrunner.hpp>
+#include <codegenerator.hpp>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include "arduinostubs.hpp"
+#include "recipe_script.hpp"
+// Generated with host/scriptcompile from RECIPE_SCRIPT
+#include "generated_recipe.hpp"
+using Catch::Matchers::Contains;
+
+using namespace rvt::scriptrunner;
+
+TEST_CASE("Should run a script translated to C++ like the interpreter", "[codegenerator]") {
+    class ExtendedContext : public Context {
+    public:
+        std::string trace;
+        ExtendedContext(const char* script) : Context(script)  {
+        }
+        ExtendedContext() {
+        }
+    };
+
+    const char* script = RECIPE_SCRIPT;
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("trace", [](const OptValue & value, ExtendedContext & context) {
+        context.trace += (char*)value;
+        return true;
+    }));
+    commands.push_back(new Command<ExtendedContext>("goto", [](const OptValue & value, ExtendedContext & context) {
+        context.jump(value);
+        return false;
+    }));
+    commands.push_back(new Command<ExtendedContext>("select", [](const OptValue & value, ExtendedContext & context) {
+        context.setRegister(1, (int32_t)value);
+        return true;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+
+    ExtendedContext interpreted{script};
+    ExtendedContext compiled;
+    recipe(compiled);
+    REQUIRE(compiled.compiledScript() != nullptr);
+
+    millisStubbed = 0;
+    int ticks = 0;
+
+    while (scriptRunner.handle(interpreted) | scriptRunner.handle(compiled)) {
+        REQUIRE(interpreted.trace == compiled.trace);
+        REQUIRE(interpreted.registerValue(0) == compiled.registerValue(0));
+        millisStubbed++;
+        ticks++;
+    }
+
+    REQUIRE(compiled.trace == "...rrsdone");
+    REQUIRE(ticks > 30);
+
+    compiled.reset();
+    compiled.trace.clear();
+
+    while (scriptRunner.handle(compiled)) {
+        millisStubbed++;
+    }
+
+    REQUIRE(compiled.trace == "...rrsdone");
+}
+
+TEST_CASE("Should match the generated recipe", "[codegenerator]") {
+    std::string path = __FILE__;
+    std::ifstream file(path.substr(0, path.find_last_of('/') + 1) + "generated_recipe.hpp");
+    std::stringstream generated;
+    generated << file.rdbuf();
+    REQUIRE(file.good());
+
+    Program program{RECIPE_SCRIPT};
+    program.optimize();
+    CodeGenerator generator;
+    // Regenerate with host/scriptcompile -n recipe when this fails
+    REQUIRE(generator.generate("recipe", program) == generated.str());
+}
+
+TEST_CASE("Should generate a case for every line", "[codegenerator]") {
+    Program program{"valve=\"open\";wait=50;jump=valve;"};
+    program.optimize();
+    CodeGenerator generator;
+    std::string code = generator.generate("brew", program);
+
+    REQUIRE_THAT(code, Contains("bool brewStep("));
+    REQUIRE_THAT(code, Contains("static const OptValue line(0, \"valve\", \"\\\"open\\\"\");"));
+    REQUIRE_THAT(code, Contains("return commands.command(context, brewSymbols()[0], line, 1);"));
+    REQUIRE_THAT(code, Contains("static const char* const names[] = {\"valve\"};"));
+    REQUIRE_THAT(code, Contains("return context.stepWait(50UL, 2);"));
+    REQUIRE_THAT(code, Contains("return true;"));
+    REQUIRE_THAT(code, Contains("context.setCompiledScript(&brewStep<Allocator>, 0, nullptr);"));
+    REQUIRE(CodeGenerator::identifier("2-brew") == "_2_brew");
+}
@@ -0,0 +1,133 @@
+#include <catch2/catch.hpp>
+
+#include <scriptrunner.hpp>
+#include <contextpool.hpp>
+#include <monotonicarena.hpp>
+#include "arduinostubs.hpp"
+using Catch::Matchers::Equals;
+
+using namespace rvt::scriptrunner;
+
+static const char* PURGE_SCRIPT =
+    "test=open;"
+    "wait=5;"
+    "test=close;";
+
+static const char* STEAM_SCRIPT =
+    "test=steam;";
+
+TEST_CASE("Should rewind a context on reset", "[contextpool]") {
+    std::vector<Command<Context>*> commands;
+    commands.push_back(new Command<Context>("test", [](const OptValue & value, Context & context) {
+        return true;
+    }));
+    ScriptRunner<Context> scriptRunner(commands);
+    Context context{PURGE_SCRIPT};
+    millisStubbed = 0;
+
+    scriptRunner.handle(context);
+    scriptRunner.handle(context);
+    REQUIRE_THAT((const char*)context.currentLine().key(), Equals("wait"));
+    context.reset();
+    REQUIRE_THAT((const char*)context.currentLine(), Equals("open"));
+
+    // The wait must start again after a reset
+    scriptRunner.handle(context);
+    millisStubbed = 100;
+    scriptRunner.handle(context);
+    REQUIRE_THAT((const char*)context.currentLine().key(), Equals("wait"));
+}
+
+TEST_CASE("Should reuse contexts of the same script", "[contextpool]") {
+    class ExtendedContext : public Context {
+    public:
+        uint16_t counter;
+        ExtendedContext(const char* script) : Context(script), counter(0)  {
+        }
+        virtual void reset() override {
+            Context::reset();
+            counter = 0;
+        }
+    };
+
+    ContextPool<ExtendedContext> pool;
+    ExtendedContext* purge = pool.acquire(PURGE_SCRIPT);
+    ExtendedContext* steam = pool.acquire(STEAM_SCRIPT);
+    REQUIRE(purge != steam);
+    REQUIRE(pool.size() == 2);
+
+    purge->counter = 5;
+    purge->jump("nothing");
+    pool.release(purge);
+    REQUIRE(purge->counter == 0);
+
+    ExtendedContext* again = pool.acquire(PURGE_SCRIPT);
+    REQUIRE(again == purge);
+    REQUIRE(pool.size() == 2);
+    REQUIRE_THAT((const char*)again->currentLine(), Equals("open"));
+
+    // purge is in use, so a second one needs to be created
+    ExtendedContext* second = pool.acquire(PURGE_SCRIPT);
+    REQUIRE(second != purge);
+    REQUIRE(pool.size() == 3);
+}
+
+TEST_CASE("Should hand out a context released while it was waiting", "[contextpool]") {
+    static const char* script = "test=open;waitfor=sensor;test=close;";
+    std::vector<Command<Context>*> commands;
+    commands.push_back(new Command<Context>("test", [](const OptValue & value, Context & context) {
+        return true;
+    }));
+    commands.push_back(new Command<Context>("waitfor", [](const OptValue & value, Context & context) {
+        return context.waitFor((const char*)value, 100);
+    }));
+    ScriptRunner<Context> scriptRunner(commands);
+    ContextPool<Context> pool;
+    SymbolTable::instance().intern("sensor");
+    millisStubbed = 1000;
+
+    Context* context = pool.acquire(script);
+    scriptRunner.handle(*context);
+    scriptRunner.handle(*context);
+    REQUIRE(context->waitingForEvent());
+    REQUIRE(context->hasTimer());
+    context->sleepUntil(2000);
+    pool.release(context);
+
+    Context* again = pool.acquire(script);
+    REQUIRE(again == context);
+    REQUIRE_FALSE(again->waitingForEvent());
+    REQUIRE_FALSE(again->hasTimer());
+    REQUIRE_FALSE(again->sleeping());
+    REQUIRE(again->wakeAt() == 0);
+    REQUIRE_THAT((const char*)again->currentLine(), Equals("open"));
+
+    // The wait starts over with it's own timeout
+    millisStubbed = 5000;
+    scriptRunner.handle(*again);
+    scriptRunner.handle(*again);
+    REQUIRE(again->waitingForEvent());
+    REQUIRE(again->wakeAt() == 5100);
+}
+
+TEST_CASE("Should take pooled contexts from the allocator", "[contextpool]") {
+    typedef BasicContext<ArenaAllocator<char>> ArenaContext;
+    char buffer[4096];
+    MonotonicArena arena(buffer, sizeof(buffer));
+
+    {
+        ContextPool<ArenaContext, ArenaAllocator<char>> pool{ArenaAllocator<char>(arena)};
+        ArenaContext* purge = pool.acquire(PURGE_SCRIPT);
+        REQUIRE(arena.used() > sizeof(ArenaContext));
+        REQUIRE(arena.overflowed() == false);
+        REQUIRE(reinterpret_cast<char*>(purge) >= buffer);
+        REQUIRE(reinterpret_cast<char*>(purge) < buffer + sizeof(buffer));
+        REQUIRE_THAT((const char*)purge->currentLine(), Equals("open"));
+
+        pool.release(purge);
+        REQUIRE(pool.acquire(PURGE_SCRIPT) == purge);
+    }
+
+    arena.release();
+    REQUIRE(arena.used() == 0);
+}
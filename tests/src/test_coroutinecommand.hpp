@@ -0,0 +1,95 @@
+#include <catch2/catch.hpp>
+
+#include <scriptrunner.hpp>
+#include <coroutinecommand.hpp>
+#include "arduinostubs.hpp"
+using Catch::Matchers::Equals;
+
+using namespace rvt::scriptrunner;
+
+class HeaterContext : public CoroutineContext<Context> {
+public:
+    std::vector<std::string> log;
+    HeaterContext(const char* script) : CoroutineContext<Context>(script) {
+    }
+};
+
+static CommandTask checkTemperature(HeaterContext& context) {
+    context.log.push_back("check");
+    co_await delay(10);
+    context.log.push_back("checked");
+}
+
+TEST_CASE("Should run a coroutine command across ticks", "[coroutinecommand]") {
+    SymbolTable::instance().intern("hot");
+    std::vector<Command<HeaterContext>*> commands;
+    commands.push_back(new CoroutineCommand<HeaterContext>("ramp", [](const OptValue&, HeaterContext & context) -> CommandTask {
+        context.log.push_back("heat");
+        co_await delay(100);
+        co_await checkTemperature(context);
+
+        if (co_await event("hot", 50)) {
+            context.log.push_back("hot");
+        } else {
+            context.log.push_back("timeout");
+        }
+
+        context.log.push_back("done");
+    }));
+    ScriptRunner<HeaterContext> scriptRunner(commands);
+
+    SECTION("signalled") {
+        millisStubbed = 0;
+        HeaterContext context{"ramp=1;"};
+        scriptRunner.start(context);
+        scriptRunner.handle();
+        REQUIRE(context.log.size() == 1);
+        REQUIRE(context.coroutineActive());
+        REQUIRE(context.frames().used() > 0);
+
+        millisStubbed = 99;
+        scriptRunner.handle();
+        REQUIRE(context.log.size() == 1);
+        millisStubbed = 100;
+        scriptRunner.handle();
+        REQUIRE(context.log.size() == 2);
+        REQUIRE_THAT(context.log[1], Equals("check"));
+
+        millisStubbed = 110;
+        scriptRunner.handle();
+        REQUIRE(context.log.size() == 3);
+        REQUIRE(context.runState() == RunState::WAITING);
+
+        scriptRunner.signal("hot");
+        scriptRunner.handle();
+        REQUIRE(context.log.size() == 5);
+        REQUIRE_THAT(context.log[3], Equals("hot"));
+        REQUIRE(context.coroutineActive() == false);
+        REQUIRE(context.frames().used() == 0);
+        REQUIRE(scriptRunner.handle() == false);
+    }
+
+    SECTION("timed out") {
+        millisStubbed = 0;
+        HeaterContext context{"ramp=1;"};
+        scriptRunner.start(context);
+
+        for (int i = 0; i < 200; i++) {
+            millisStubbed++;
+            scriptRunner.handle();
+        }
+
+        REQUIRE(context.log.size() == 5);
+        REQUIRE_THAT(context.log[3], Equals("timeout"));
+    }
+
+    SECTION("reset while suspended") {
+        millisStubbed = 0;
+        HeaterContext context{"ramp=1;"};
+        scriptRunner.handle(context);
+        REQUIRE(context.coroutineActive());
+        context.reset();
+        REQUIRE(context.coroutineActive() == false);
+        REQUIRE(context.frames().used() == 0);
+    }
+}
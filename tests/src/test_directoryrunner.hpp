@@ -0,0 +1,110 @@
+#include <catch2/catch.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+
+#include <scriptrunner.hpp>
+#include <directoryrunner.hpp>
+#include "arduinostubs.hpp"
+
+using namespace rvt::scriptrunner;
+
+static void writeScript(const std::string& path, const char* script) {
+    FILE* file = fopen(path.c_str(), "w");
+    fputs(script, file);
+    fclose(file);
+}
+
+TEST_CASE("Should run and reload the scripts of a directory", "[directoryrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        std::string value;
+        ExtendedContext(const char* script) : Context(script)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("set", [](const OptValue & value, ExtendedContext & context) {
+        context.value = (char*)value;
+        return true;
+    }));
+
+    char directory[] = "/tmp/scriptrunnerXXXXXX";
+    REQUIRE(mkdtemp(directory) != nullptr);
+    std::string path(directory);
+    writeScript(path + "/first", "set=one;label=top;wait=1000;jump=top;");
+    writeScript(path + "/second", "set=two;");
+    writeScript(path + "/.hidden", "set=hidden;");
+    writeScript(path + "/backup~", "set=backup;");
+    millisStubbed = 0;
+
+    {
+        DirectoryRunner<ExtendedContext> runner(commands, directory);
+        REQUIRE(runner.valid());
+        std::vector<std::string> loaded;
+        runner.onLoaded([&loaded](const char* name, ExtendedContext & context) {
+            loaded.push_back(name);
+        });
+        REQUIRE(runner.load() == 2);
+        REQUIRE(loaded.size() == 2);
+        REQUIRE(runner.context(".hidden") == nullptr);
+
+        runner.runOnce(0);
+        runner.runOnce(0);
+        REQUIRE(runner.context("first")->value == "one");
+        REQUIRE(runner.context("second")->value == "two");
+
+        SECTION("sleeps until the next timer") {
+            runner.runOnce(0);
+            runner.runOnce(0);
+            REQUIRE(runner.context("first")->runState() == RunState::WAITING);
+            auto start = std::chrono::steady_clock::now();
+            millisStubbed = 950;
+            runner.runOnce();
+            auto slept = std::chrono::steady_clock::now() - start;
+            REQUIRE(slept >= std::chrono::milliseconds(40));
+            REQUIRE(slept < std::chrono::milliseconds(900));
+        }
+
+        SECTION("reloads changed files") {
+            ExtendedContext* old = runner.context("first");
+            writeScript(path + "/first", "set=changed;");
+            runner.runOnce(1000);
+            REQUIRE(runner.context("first") != old);
+            runner.runOnce(0);
+            REQUIRE(runner.context("first")->value == "changed");
+            REQUIRE(loaded.size() == 3);
+        }
+
+        SECTION("drops deleted files") {
+            unlink((path + "/second").c_str());
+            runner.runOnce(1000);
+            REQUIRE(runner.context("second") == nullptr);
+            REQUIRE(runner.size() == 1);
+        }
+
+        SECTION("wakes up on request") {
+            runner.wake();
+            REQUIRE(runner.runOnce());
+            runner.stop();
+            REQUIRE_FALSE(runner.runOnce());
+        }
+    }
+
+    for (const char* name : {
+                "/first", "/second", "/.hidden", "/backup~"
+            }) {
+        unlink((path + name).c_str());
+    }
+
+    rmdir(directory);
+}
+
+TEST_CASE("Should not be valid for a directory that does not exist", "[directoryrunner]") {
+    std::vector<Command<Context>*> commands;
+    DirectoryRunner<Context> runner(commands, "/tmp/scriptrunner-does-not-exist");
+    REQUIRE_FALSE(runner.valid());
+}
@@ -0,0 +1,308 @@
+#include <catch2/catch.hpp>
+
+#include <scriptprogram.hpp>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+using Catch::Matchers::Equals;
+
+using namespace rvt::scriptrunner;
+
+TEST_CASE("Should compile a script into compact lines", "[scriptprogram]") {
+    Program program{
+        "wait=50;"
+        "test=foo;"
+        "wait=50;"
+        "label=foo;"};
+
+    REQUIRE(sizeof(ScriptLine) <= 3 * sizeof(ScriptOffset));
+    REQUIRE(program.size() == 5);
+
+    REQUIRE(program.line(0).m_opcode == Opcode::WAIT);
+    REQUIRE(program.line(1).m_opcode == Opcode::COMMAND);
+    REQUIRE(program.line(3).m_opcode == Opcode::LABEL);
+    REQUIRE(program.line(4).m_opcode == Opcode::END);
+    REQUIRE_THAT(program.key(program.line(1)), Equals("test"));
+    REQUIRE_THAT(program.string(program.line(1).m_value), Equals("foo"));
+    REQUIRE_THAT(program.string(program.line(4).m_value), Equals(""));
+}
+
+TEST_CASE("Should store each string only once", "[scriptprogram]") {
+    Program program{
+        "wait=50;"
+        "wait=50;"
+        "test=foo;"
+        "label=foo;"};
+
+    REQUIRE(program.line(0).m_symbol == program.line(1).m_symbol);
+    REQUIRE(program.line(0).m_value == program.line(1).m_value);
+    // Keys live in the SymbolTable, only "", 50 and foo are in the pool
+    REQUIRE(program.memoryUsage() == program.size() * sizeof(ScriptLine) + 1 + 3 + 4);
+}
+
+TEST_CASE("Should store each string once in a long script", "[scriptprogram]") {
+    std::string script;
+
+    for (int i = 0; i < 2000; i++) {
+        script += "test=" + std::to_string(i) + ";test=" + std::to_string(i / 2) + ";";
+    }
+
+    Program program{script.c_str()};
+    program.optimize(false);
+
+    for (size_t i = 0; i < 2000; i++) {
+        REQUIRE_THAT(program.string(program.line(i * 2).m_value), Equals(std::to_string(i)));
+        REQUIRE(program.line(i * 2 + 1).m_value == program.line((i / 2) * 2).m_value);
+    }
+
+    // Appending after optimize() finds the strings that are already in the pool
+    ScriptOffset seven = program.line(14).m_value;
+    program.compile("test=7;");
+    REQUIRE(program.line(4001).m_value == seven);
+}
+
+TEST_CASE("Should intern keys and labels across programs", "[scriptprogram]") {
+    Program first{"test=foo;jump=there;label=there;"};
+    Program second{"test=bar;label=there;"};
+    SymbolTable& symbols = SymbolTable::instance();
+
+    REQUIRE(first.line(0).m_symbol == second.line(0).m_symbol);
+    REQUIRE(first.line(0).m_symbol == symbols.find("test"));
+    REQUIRE(first.line(1).m_symbol == SymbolTable::JUMP);
+    REQUIRE(first.line(1).m_value == first.line(2).m_value);
+    REQUIRE(first.line(2).m_value == second.line(1).m_value);
+    REQUIRE_THAT(first.value(first.line(1)), Equals("there"));
+    REQUIRE(first.key(first.line(0)) == second.key(second.line(0)));
+    REQUIRE(symbols.find("never used") == SymbolTable::NOT_FOUND);
+}
+
+TEST_CASE("Should thread jumps and drop labels and dead lines", "[scriptprogram]") {
+    Program program{
+        "jump=first;"
+        "test=dead;"
+        "label=first;"
+        "jump=second;"
+        "test=dead;"
+        "label=second;"
+        "label=alias;"
+        "test=live;"
+        "jump=done;"
+        "test=dead;"
+        "label=done;"
+        "end=1;"
+        "test=dead;"};
+    program.optimize(false);
+    size_t line;
+
+    // Labelled lines stay since commands may jump there, the jump at first is still needed for that
+    REQUIRE(program.size() == 6);
+    REQUIRE(program.line(0).m_opcode == Opcode::GOTO);
+    REQUIRE(program.line(0).m_value == 2);
+    REQUIRE_THAT(program.value(program.line(0)), Equals("second"));
+    REQUIRE_THAT(program.key(program.line(0)), Equals("jump"));
+    REQUIRE(program.line(1).m_opcode == Opcode::GOTO);
+    REQUIRE(program.line(1).m_value == 2);
+    REQUIRE_THAT(program.string(program.line(2).m_value), Equals("live"));
+    // A jump to an end is that end
+    REQUIRE(program.line(3).m_opcode == Opcode::END);
+    REQUIRE(program.line(4).m_opcode == Opcode::END);
+    REQUIRE(program.line(5).m_opcode == Opcode::END);
+
+    // Labels can still be jumped to by name
+    REQUIRE(program.label(SymbolTable::instance().find("first"), line));
+    REQUIRE(line == 1);
+    REQUIRE(program.label(SymbolTable::instance().find("alias"), line));
+    REQUIRE(line == 2);
+    REQUIRE(program.label(SymbolTable::instance().find("done"), line));
+    REQUIRE(line == 4);
+    REQUIRE_FALSE(program.label(SymbolTable::instance().find("test"), line));
+}
+
+TEST_CASE("Should keep jumps that go round in circles", "[scriptprogram]") {
+    Program program{
+        "test=1;"
+        "label=spin;"
+        "jump=spin;"
+        "jump=nowhere;"};
+    program.optimize(false);
+
+    REQUIRE(program.size() == 3);
+    REQUIRE(program.line(1).m_opcode == Opcode::GOTO);
+    REQUIRE(program.line(1).m_value == 1);
+    REQUIRE(program.line(2).m_opcode == Opcode::END);
+
+    program.compile("label=more;jump=spin;jump=more;");
+    program.optimize(false);
+    size_t line;
+
+    // The old end can't be reached anymore
+    REQUIRE(program.size() == 4);
+    REQUIRE(program.line(2).m_opcode == Opcode::GOTO);
+    REQUIRE(program.line(2).m_value == 1);
+    REQUIRE(program.label(SymbolTable::instance().find("more"), line));
+    REQUIRE(line == 2);
+}
+
+TEST_CASE("Should merge waits and fold no-ops", "[scriptprogram]") {
+    const char* script =
+        "wait=10;"
+        "wait=40;"
+        "test=1;"
+        "wait=0;"
+        "jump=next;"
+        "label=next;"
+        "wait=5;"
+        "label=again;"
+        "wait=5;"
+        "wait=name;"
+        "jump=again;";
+    Program program{script};
+    program.optimize();
+    size_t line;
+
+    REQUIRE(program.size() == 7);
+    REQUIRE(program.line(0).m_opcode == Opcode::WAIT);
+    REQUIRE_THAT(program.value(program.line(0)), Equals("50"));
+    REQUIRE_THAT(program.value(program.line(1)), Equals("1"));
+    // A labelled wait is not merged into the one before it
+    REQUIRE_THAT(program.value(program.line(2)), Equals("5"));
+    REQUIRE_THAT(program.value(program.line(3)), Equals("5"));
+    REQUIRE_THAT(program.value(program.line(4)), Equals("name"));
+    REQUIRE(program.line(5).m_opcode == Opcode::GOTO);
+    REQUIRE(program.line(5).m_value == 3);
+    REQUIRE(program.label(SymbolTable::instance().find("next"), line));
+    REQUIRE(line == 2);
+
+    Program debug{script};
+    debug.optimize(false);
+    REQUIRE(debug.size() == 10);
+}
+
+TEST_CASE("Should include modules when loading", "[scriptprogram]") {
+    ModuleTable& modules = ModuleTable::instance();
+    modules.add("preinfuse", "valve=open;wait=500;valve=closed;end;label=flush;valve=flush;return;");
+    modules.add("brew", "include=preinfuse;pump=on;repeat=2;wait=25000;endrepeat;pump=off;");
+    REQUIRE(modules.size() == 2);
+    REQUIRE(modules.memoryUsage() > 0);
+
+    Program program{"light=on;include=brew;include=missing;include=preinfuse;call=flush;light=off;"};
+    program.optimize(false);
+
+    // Only a far call is added for a module, it's lines stay in the module
+    REQUIRE(program.size() == 7);
+    REQUIRE(program.line(1).m_opcode == Opcode::FARCALL);
+    REQUIRE_THAT(program.key(program.line(1)), Equals("include"));
+    REQUIRE_THAT(program.value(program.line(1)), Equals("brew"));
+    REQUIRE_THAT(program.key(program.line(2)), Equals("include"));
+    REQUIRE(program.line(2).m_opcode == Opcode::COMMAND);
+    REQUIRE(program.line(4).m_opcode == Opcode::FARCALL);
+    REQUIRE_THAT(program.value(program.line(4)), Equals("flush"));
+    REQUIRE(program.line(6).m_opcode == Opcode::END);
+
+    REQUIRE(program.modules() == 2);
+    REQUIRE(&program.module(0) == modules.find(SymbolTable::instance().find("brew")).get());
+    const ScriptFarCall& flush = program.farCallAt(program.line(4).m_value);
+    REQUIRE(flush.m_module == 1);
+    REQUIRE_THAT(program.module(1).value(program.module(1).line(flush.m_line)), Equals("flush"));
+    // The loop of brew, the module is reached through the program only once
+    REQUIRE(program.loops() == 0);
+    REQUIRE(program.counters() == 1);
+
+    // Replacing a module does not change programs that included it
+    size_t size = program.module(1).size();
+    modules.add("preinfuse", "valve=open;");
+    REQUIRE(program.module(1).size() == size);
+    Program replaced{"include=preinfuse;"};
+    replaced.optimize();
+    REQUIRE(replaced.module(0).size() == 2);
+
+    REQUIRE(modules.remove("brew"));
+    REQUIRE(modules.remove("preinfuse"));
+    REQUIRE_FALSE(modules.remove("brew"));
+    REQUIRE(modules.size() == 0);
+}
+
+TEST_CASE("Should not load scripts that don't fit in ScriptOffset", "[scriptprogram]") {
+    const size_t limit = std::numeric_limits<ScriptOffset>::max();
+
+    SECTION("too much text") {
+        std::string script;
+
+        for (size_t i = 0; script.size() <= limit + 2000; i++) {
+            script += "test=" + std::to_string(i) + std::string(1000, 'x') + ";";
+        }
+
+        Program program{script.c_str()};
+        REQUIRE_FALSE(program.valid());
+        program.optimize();
+        REQUIRE(program.size() == 1);
+        REQUIRE(program.line(0).m_opcode == Opcode::END);
+    }
+
+    SECTION("too many lines") {
+        std::string script;
+
+        for (size_t i = 0; i <= limit; i++) {
+            script += "test;";
+        }
+
+        Program program{script.c_str()};
+        REQUIRE_FALSE(program.valid());
+        program.optimize();
+        REQUIRE(program.size() == 1);
+    }
+
+    SECTION("just fits") {
+        Program program{"test=foo;label=top;jump=top;"};
+        program.optimize();
+        REQUIRE(program.valid());
+    }
+}
+
+TEST_CASE("Should find names and ids across blocks of the symbol table", "[scriptprogram]") {
+    SymbolTable& symbols = SymbolTable::instance();
+    std::vector<SymbolId> ids;
+
+    for (int i = 0; i < 1000; i++) {
+        ids.push_back(symbols.intern(("spread over blocks " + std::to_string(i)).c_str()));
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        std::string name = "spread over blocks " + std::to_string(i);
+        REQUIRE(ids[i] != SymbolTable::NOT_FOUND);
+        REQUIRE(symbols.find(name.c_str()) == ids[i]);
+        REQUIRE(symbols.find((name + "tail").c_str(), name.size()) == ids[i]);
+        REQUIRE(symbols.name(ids[i]) == name);
+    }
+
+    REQUIRE(symbols.find("spread over blocks 1000") == SymbolTable::NOT_FOUND);
+    REQUIRE(symbols.find("jfalse") == SymbolTable::JFALSE);
+}
+
+TEST_CASE("Should look up names while another thread interns", "[scriptprogram]") {
+    SymbolTable& symbols = SymbolTable::instance();
+    const SymbolId known = symbols.intern("looked up while interning");
+    std::atomic<bool> done{false};
+    size_t mismatches = 0;
+
+    // Catch is not thread safe, so the reader only counts
+    std::thread reader([&]() {
+        while (!done) {
+            mismatches += symbols.find("looked up while interning") != known;
+            mismatches += strcmp(symbols.name(known), "looked up while interning") != 0;
+        }
+    });
+
+    for (int i = 0; i < 200; i++) {
+        symbols.intern(("interned while looking up " + std::to_string(i)).c_str());
+    }
+
+    done = true;
+    reader.join();
+
+    REQUIRE(mismatches == 0);
+    SymbolId last = symbols.find("interned while looking up 199");
+    REQUIRE(last != SymbolTable::NOT_FOUND);
+    REQUIRE_THAT(symbols.name(last), Equals("interned while looking up 199"));
+}
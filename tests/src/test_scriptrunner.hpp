@@ -1,7 +1,9 @@
 #include <catch2/catch.hpp>
 
 #include <scriptrunner.hpp>
+#include <monotonicarena.hpp>
 #include <iostream>
+#include <thread>
 #include "arduinostubs.hpp"
 using Catch::Matchers::Equals;
 
@@ -44,6 +46,17 @@ TEST_CASE("Should Run script till end", "[scriptrunner]") {
     REQUIRE(returned == false);
 }
 
+TEST_CASE("Should end a context created without a script", "[scriptrunner]") {
+    std::vector<Command<Context>*> commands;
+    ScriptRunner<Context> scriptRunner(commands);
+    Context context;
+
+    REQUIRE(context.hasProgram() == false);
+    REQUIRE(context.currentSymbol() == SymbolTable::END);
+    REQUIRE(context.jump("anywhere") == false);
+    REQUIRE(scriptRunner.handle(context) == false);
+}
+
 TEST_CASE("Should handle an extendedContext", "[scriptrunner]") {
 
     class ExtendedContext : public Context {
@@ -154,6 +167,59 @@ TEST_CASE("Should perform jump, even as first line", "[scriptrunner]") {
     REQUIRE(context.counter == 1);
 }
 
+TEST_CASE("Should run the first line after a label a command jumped to", "[scriptrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        std::string hits;
+        ExtendedContext(const char* script) : Context(script)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("hit", [](const OptValue & value, ExtendedContext & context) {
+        context.hits += (char*)value;
+        return true;
+    }));
+    // Asks to advance after jumping, the jump wins
+    commands.push_back(new Command<ExtendedContext>("go", [](const OptValue & value, ExtendedContext & context) {
+        context.jump(value);
+        return true;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+
+    ExtendedContext context{"go=there;hit=skipped;label=there;hit=run;"};
+
+    while (scriptRunner.handle(context)) {
+    }
+
+    REQUIRE(context.hits == "run");
+}
+
+TEST_CASE("Should keep the line of a command that moves the context", "[scriptrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        std::string seen;
+        ExtendedContext(const char* script) : Context(script)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("go", [](const OptValue & value, ExtendedContext & context) {
+        context.jump(value);
+        context.seen += value.key();
+        context.seen += "=";
+        context.seen += (char*)value;
+        context.reset();
+        context.seen += (char*)value;
+        return false;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+
+    ExtendedContext context{"go=there;label=there;hit=1;"};
+    scriptRunner.handle(context);
+    REQUIRE(context.seen == "go=therethere");
+}
+
 TEST_CASE("Should handle waits", "[scriptrunner]") {
     class ExtendedContext : public Context {
     public:
@@ -182,7 +248,966 @@ TEST_CASE("Should handle waits", "[scriptrunner]") {
     scriptRunner->handle(context);
     scriptRunner->handle(context);
     REQUIRE_THAT((const char*)context.value, Equals("before"));
+    millisStubbed = 50;
+    scriptRunner->handle(context);
+    scriptRunner->handle(context);
+    REQUIRE_THAT((const char*)context.value, Equals("before"));
     millisStubbed = 51;
     scriptRunner->handle(context);
+    scriptRunner->handle(context);
     REQUIRE_THAT((const char*)context.value, Equals("after"));
 }
+
+TEST_CASE("Should run a script from an arena", "[scriptrunner]") {
+    typedef BasicContext<ArenaAllocator<char>> ArenaContext;
+    char buffer[1024];
+    MonotonicArena arena(buffer, sizeof(buffer));
+
+    std::vector<Command<ArenaContext>*> commands;
+    commands.push_back(new Command<ArenaContext>("test", [](const OptValue & value, ArenaContext & context) {
+        return true;
+    }));
+
+    auto context = new ArenaContext{
+        "test=foo;"
+        "test=bar;", ArenaAllocator<char>(arena)};
+    ScriptRunner<ArenaContext, ArenaAllocator<char>> scriptRunner(commands, ArenaAllocator<char>(arena));
+
+    REQUIRE(arena.used() > 0);
+    REQUIRE(arena.overflowed() == false);
+    REQUIRE_THAT((const char*)context->currentLine(), Equals("foo"));
+    REQUIRE(scriptRunner.handle(*context) == true);
+    REQUIRE_THAT((const char*)context->currentLine(), Equals("bar"));
+    REQUIRE(scriptRunner.handle(*context) == true);
+    REQUIRE(scriptRunner.handle(*context) == false);
+
+    delete context;
+    arena.release();
+    REQUIRE(arena.used() == 0);
+}
+
+TEST_CASE("Should start, pause, resume and abort contexts on the runner", "[scriptrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        uint16_t counter;
+        ExtendedContext(const char* script) : Context(script), counter(0)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("count", [](const OptValue & value, ExtendedContext & context) {
+        context.counter++;
+        return true;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+    std::vector<ExtendedContext*> finished;
+    scriptRunner.onFinished([&finished](ExtendedContext & context) {
+        finished.push_back(&context);
+    });
+
+    ExtendedContext first{"count=1;count=1;count=1;"};
+    ExtendedContext second{"label=top;count=1;jump=top;"};
+
+    REQUIRE(scriptRunner.handle() == false);
+    scriptRunner.start(first);
+    scriptRunner.start(second);
+    REQUIRE(first.runState() == RunState::STOPPED);
+
+    REQUIRE(scriptRunner.handle() == true);
+    REQUIRE(first.runState() == RunState::RUNNING);
+    REQUIRE(first.counter == 1);
+
+    scriptRunner.pause(first);
+    scriptRunner.handle();
+    scriptRunner.handle();
+    REQUIRE(first.runState() == RunState::PAUSED);
+    REQUIRE(first.counter == 1);
+
+    scriptRunner.resume(first);
+
+    for (int i = 0; i < 10; i++) {
+        scriptRunner.handle();
+    }
+
+    REQUIRE(first.counter == 3);
+    REQUIRE(first.runState() == RunState::STOPPED);
+    REQUIRE(finished.size() == 1);
+    REQUIRE(finished[0] == &first);
+
+    scriptRunner.abort(second);
+    REQUIRE(scriptRunner.handle() == false);
+    REQUIRE(second.runState() == RunState::STOPPED);
+    REQUIRE(finished.size() == 1);
+}
+
+TEST_CASE("Should apply requests posted before handle in order", "[scriptrunner]") {
+    std::vector<Command<Context>*> commands;
+    commands.push_back(new Command<Context>("test", [](const OptValue & value, Context & context) {
+        return true;
+    }));
+    ScriptRunner<Context> scriptRunner(commands);
+
+    Context context{"test=1;test=1;"};
+    scriptRunner.start(context);
+    scriptRunner.pause(context);
+    scriptRunner.handle();
+    REQUIRE(context.runState() == RunState::PAUSED);
+    REQUIRE(context.lineNumber() == 0);
+
+    scriptRunner.resume(context);
+    scriptRunner.handle();
+    REQUIRE(context.runState() == RunState::RUNNING);
+    REQUIRE(context.lineNumber() == 1);
+
+    Context other{"test=1;test=1;"};
+    scriptRunner.start(other);
+    scriptRunner.pause(other);
+    scriptRunner.resume(other);
+    scriptRunner.handle();
+    REQUIRE(other.runState() == RunState::RUNNING);
+    REQUIRE(other.lineNumber() == 1);
+
+    Context aborted{"test=1;test=1;"};
+    scriptRunner.start(aborted);
+    scriptRunner.abort(aborted);
+    scriptRunner.start(aborted);
+    scriptRunner.handle();
+    REQUIRE(aborted.runState() == RunState::RUNNING);
+}
+
+TEST_CASE("Should take requests from other threads while running", "[scriptrunner]") {
+    std::vector<Command<Context>*> commands;
+    commands.push_back(new Command<Context>("test", [](const OptValue & value, Context & context) {
+        return true;
+    }));
+    ScriptRunner<Context> scriptRunner(commands);
+    size_t finished = 0;
+    scriptRunner.onFinished([&finished](Context & context) {
+        finished++;
+    });
+
+    std::vector<std::unique_ptr<Context>> contexts;
+
+    for (int i = 0; i < 400; i++) {
+        contexts.push_back(std::unique_ptr<Context>(new Context("test=1;test=2;")));
+    }
+
+    std::atomic<bool> done{false};
+    std::thread producers[4];
+
+    for (int p = 0; p < 4; p++) {
+        producers[p] = std::thread([&contexts, &scriptRunner, p]() {
+            for (size_t i = p; i < contexts.size(); i += 4) {
+                scriptRunner.start(*contexts[i]);
+            }
+        });
+    }
+
+    std::thread joiner([&producers, &done]() {
+        for (auto& producer : producers) {
+            producer.join();
+        }
+
+        done = true;
+    });
+
+    while (!done || scriptRunner.handle()) {
+        scriptRunner.handle();
+    }
+
+    joiner.join();
+    REQUIRE(finished == contexts.size());
+}
+
+TEST_CASE("Should park contexts that wait for an event", "[scriptrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        uint16_t calls;
+        bool timedOut;
+        ExtendedContext(const char* script) : Context(script), calls(0), timedOut(false)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("waitfor", [](const OptValue & value, ExtendedContext & context) {
+        context.calls++;
+
+        if (context.waitFor((const char*)value, 100)) {
+            context.timedOut = context.eventTimedOut();
+            return true;
+        }
+
+        return false;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+    millisStubbed = 1000;
+
+    ExtendedContext heated{"waitfor=temperature;"};
+    ExtendedContext pressed{"waitfor=button;"};
+    // Event names are interned when the scripts are loaded, waitFor() only looks them up
+    heated.program().internValues("waitfor");
+    pressed.program().internValues("waitfor");
+    scriptRunner.start(heated);
+    scriptRunner.start(pressed);
+
+    REQUIRE(scriptRunner.handle() == true);
+    REQUIRE(heated.runState() == RunState::WAITING);
+    REQUIRE(pressed.runState() == RunState::WAITING);
+
+    for (int i = 0; i < 10; i++) {
+        millisStubbed++;
+        REQUIRE(scriptRunner.handle() == true);
+    }
+
+    // Parked contexts are not polled
+    REQUIRE(heated.calls == 1);
+    REQUIRE(pressed.calls == 1);
+
+    scriptRunner.signal("temperature");
+    scriptRunner.handle();
+    REQUIRE(heated.calls == 2);
+    REQUIRE(heated.timedOut == false);
+    REQUIRE(pressed.runState() == RunState::WAITING);
+
+    millisStubbed = 1100;
+    scriptRunner.handle();
+    REQUIRE(pressed.calls == 2);
+    REQUIRE(pressed.timedOut == true);
+
+    while (scriptRunner.handle()) {
+    }
+
+    REQUIRE(heated.runState() == RunState::STOPPED);
+    REQUIRE(pressed.runState() == RunState::STOPPED);
+}
+
+TEST_CASE("Should not park a context on an event that was never interned", "[scriptrunner]") {
+    std::vector<Command<Context>*> commands;
+    commands.push_back(new Command<Context>("waitfor", [](const OptValue & value, Context & context) {
+        return context.waitFor((const char*)value);
+    }));
+    ScriptRunner<Context> scriptRunner(commands);
+    Context context{"waitfor=never interned event;"};
+    scriptRunner.start(context);
+    scriptRunner.handle();
+
+    REQUIRE(scriptRunner.handle() == false);
+    REQUIRE(context.runState() == RunState::STOPPED);
+    REQUIRE(context.eventTimedOut());
+    REQUIRE(scriptRunner.signal("never interned event") == false);
+    REQUIRE(scriptRunner.signal("end"));
+}
+
+TEST_CASE("Should wake parked contexts on a posted signal", "[scriptrunner]") {
+    std::vector<Command<Context>*> commands;
+    commands.push_back(new Command<Context>("waitfor", [](const OptValue & value, Context & context) {
+        return context.waitFor((const char*)value);
+    }));
+    ScriptRunner<Context> scriptRunner(commands);
+    Context context{"waitfor=sensor;"};
+    SymbolTable::instance().intern("sensor");
+    scriptRunner.start(context);
+    scriptRunner.handle();
+    REQUIRE(context.runState() == RunState::WAITING);
+
+    std::thread isr([&scriptRunner]() {
+        scriptRunner.postSignal(SymbolTable::instance().find("sensor"));
+    });
+    isr.join();
+
+    scriptRunner.handle();
+    REQUIRE(context.runState() == RunState::RUNNING);
+    REQUIRE(scriptRunner.handle() == false);
+}
+
+TEST_CASE("Should wait for an event on a context handled directly", "[scriptrunner]") {
+    std::vector<Command<Context>*> commands;
+    commands.push_back(new Command<Context>("waitfor", [](const OptValue & value, Context & context) {
+        return context.waitFor((const char*)value, 50);
+    }));
+    ScriptRunner<Context> scriptRunner(commands);
+    millisStubbed = 0;
+
+    Context signalled{"waitfor=sensor;"};
+    Context timedOut{"waitfor=sensor;"};
+    scriptRunner.handle(signalled);
+    scriptRunner.handle(timedOut);
+    REQUIRE(signalled.signal(SymbolTable::instance().find("sensor")));
+    scriptRunner.handle(signalled);
+    REQUIRE(signalled.eventTimedOut() == false);
+    REQUIRE_THAT((const char*)signalled.currentLine().key(), Equals("end"));
+
+    scriptRunner.handle(timedOut);
+    REQUIRE_THAT((const char*)timedOut.currentLine().key(), Equals("waitfor"));
+    millisStubbed = 50;
+    scriptRunner.handle(timedOut);
+    REQUIRE(timedOut.eventTimedOut() == true);
+    REQUIRE_THAT((const char*)timedOut.currentLine().key(), Equals("end"));
+}
+
+TEST_CASE("Should honor retry and sleep results of commands", "[scriptrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        uint16_t polls;
+        ExtendedContext(const char* script) : Context(script), polls(0)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("poll", [](const OptValue & value, ExtendedContext & context) {
+        if (++context.polls == 3) {
+            return CommandResult::advance();
+        }
+
+        return CommandResult::sleepFor(200);
+    }));
+    commands.push_back(new Command<ExtendedContext>("retry", [](const OptValue & value, ExtendedContext & context) {
+        return ++context.polls == 2 ? CommandResult::advance() : CommandResult::retry();
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+
+    SECTION("handled directly") {
+        millisStubbed = 0;
+        ExtendedContext context{"poll=1;"};
+
+        for (int i = 0; i < 50; i++) {
+            scriptRunner.handle(context);
+        }
+
+        REQUIRE(context.polls == 1);
+        REQUIRE(context.sleeping());
+        millisStubbed = 200;
+        scriptRunner.handle(context);
+        REQUIRE(context.polls == 2);
+        millisStubbed = 400;
+        scriptRunner.handle(context);
+        REQUIRE(context.polls == 3);
+        REQUIRE_THAT((const char*)context.currentLine().key(), Equals("end"));
+    }
+
+    SECTION("started on the runner") {
+        millisStubbed = 0;
+        ExtendedContext context{"poll=1;"};
+        scriptRunner.start(context);
+
+        for (int i = 0; i < 50; i++) {
+            scriptRunner.handle();
+        }
+
+        REQUIRE(context.polls == 1);
+        REQUIRE(context.runState() == RunState::WAITING);
+        millisStubbed = 200;
+        scriptRunner.handle();
+        REQUIRE(context.polls == 2);
+        millisStubbed = 400;
+        scriptRunner.handle();
+        REQUIRE(context.polls == 3);
+        REQUIRE(scriptRunner.handle() == false);
+    }
+
+    SECTION("retry") {
+        ExtendedContext context{"retry=1;"};
+        scriptRunner.handle(context);
+        REQUIRE_THAT((const char*)context.currentLine().key(), Equals("retry"));
+        scriptRunner.handle(context);
+        REQUIRE_THAT((const char*)context.currentLine().key(), Equals("end"));
+    }
+}
+
+TEST_CASE("Should stop handling when the budget is used", "[scriptrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        uint16_t counter;
+        ExtendedContext(const char* script) : Context(script), counter(0)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("count", [](const OptValue & value, ExtendedContext & context) {
+        context.counter++;
+        microsStubbed += 100;
+        return true;
+    }));
+    commands.push_back(new Command<ExtendedContext>("poll", [](const OptValue & value, ExtendedContext & context) {
+        return false;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+    const char* script = "label=top;count=1;jump=top;";
+    ExtendedContext first{script};
+    ExtendedContext second{script};
+    ExtendedContext third{script};
+    scriptRunner.start(first);
+    scriptRunner.start(second);
+    scriptRunner.start(third);
+
+    SECTION("lines") {
+        // 2 lines per loop since the label is not executed, 10 lines is 2 counts for each context
+        scriptRunner.handle(10);
+        REQUIRE(first.counter + second.counter + third.counter == 6);
+
+        // The next call continues where we stopped, so over time every context gets the same share
+        for (int i = 0; i < 14; i++) {
+            scriptRunner.handle(10);
+        }
+
+        REQUIRE(first.counter + second.counter + third.counter == 75);
+        REQUIRE(first.counter == 25);
+        REQUIRE(second.counter == 25);
+        REQUIRE(third.counter == 25);
+    }
+
+    SECTION("micro seconds") {
+        microsStubbed = 0;
+        scriptRunner.handle(0, 1000);
+        REQUIRE(first.counter + second.counter + third.counter == 10);
+        REQUIRE(microsStubbed == 1000);
+    }
+
+    SECTION("no progress") {
+        ExtendedContext polling{"poll=1;"};
+        scriptRunner.abort(first);
+        scriptRunner.abort(second);
+        scriptRunner.abort(third);
+        scriptRunner.start(polling);
+        REQUIRE(scriptRunner.handle(1000) == true);
+        REQUIRE_THAT((const char*)polling.currentLine().key(), Equals("poll"));
+    }
+}
+
+TEST_CASE("Should schedule contexts by priority and deadline", "[scriptrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        uint16_t counter;
+        ExtendedContext(const char* script) : Context(script), counter(0)  {
+        }
+    };
+
+    std::vector<ExtendedContext*> order;
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("count", [&order](const OptValue & value, ExtendedContext & context) {
+        context.counter++;
+        order.push_back(&context);
+        return true;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+    const char* script = "label=top;count=1;jump=top;";
+    ExtendedContext display{script};
+    ExtendedContext shutoff{script};
+    ExtendedContext heater{script};
+    scriptRunner.start(display);
+    scriptRunner.start(shutoff);
+    scriptRunner.start(heater);
+
+    SECTION("priority") {
+        scriptRunner.schedulingPolicy(SchedulingPolicy::PRIORITY);
+        shutoff.setPriority(10);
+        heater.setPriority(5);
+        scriptRunner.handle();
+        scriptRunner.handle();
+        REQUIRE(order.size() == 3);
+        REQUIRE(order[0] == &shutoff);
+        REQUIRE(order[1] == &heater);
+        REQUIRE(order[2] == &display);
+
+        // With a tight budget only the most important context gets to run
+        for (int i = 0; i < 30; i++) {
+            scriptRunner.handle(1);
+        }
+
+        REQUIRE(shutoff.counter == 16);
+        REQUIRE(heater.counter == 1);
+        REQUIRE(display.counter == 1);
+    }
+
+    SECTION("equal priority takes turns") {
+        scriptRunner.schedulingPolicy(SchedulingPolicy::PRIORITY);
+        display.setPriority(1);
+        heater.setPriority(1);
+        shutoff.setPriority(0);
+
+        for (int i = 0; i < 30; i++) {
+            scriptRunner.handle(2);
+        }
+
+        REQUIRE(display.counter == 15);
+        REQUIRE(heater.counter == 15);
+        REQUIRE(shutoff.counter == 0);
+    }
+
+    SECTION("earliest deadline") {
+        scriptRunner.schedulingPolicy(SchedulingPolicy::EARLIEST_DEADLINE);
+        display.setDeadline(300);
+        heater.setDeadline(200);
+        shutoff.setPriority(10);
+        scriptRunner.handle();
+        REQUIRE(order.size() == 3);
+        REQUIRE(order[0] == &heater);
+        REQUIRE(order[1] == &display);
+        REQUIRE(order[2] == &shutoff);
+
+        heater.setDeadline(400);
+        order.clear();
+        scriptRunner.handle();
+        scriptRunner.handle();
+        REQUIRE(order.size() == 3);
+        REQUIRE(order[0] == &display);
+        REQUIRE(order[1] == &heater);
+    }
+}
+
+TEST_CASE("Should batch wake ups within the timer slack", "[scriptrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        uint32_t ranAt;
+        ExtendedContext(const char* script) : Context(script), ranAt(0)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("mark", [](const OptValue & value, ExtendedContext & context) {
+        context.ranAt = millis();
+        return true;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+    ExtendedContext first{"wait=100;mark=1;"};
+    ExtendedContext second{"wait=103;mark=1;"};
+    ExtendedContext third{"wait=108;mark=1;"};
+    ExtendedContext late{"wait=200;mark=1;"};
+    millisStubbed = 1000;
+    uint32_t wakeAt;
+
+    SECTION("without slack every wait wakes on it's own") {
+        scriptRunner.start(first);
+        scriptRunner.start(second);
+        scriptRunner.handle();
+        REQUIRE(scriptRunner.nextWakeup(wakeAt));
+        REQUIRE(wakeAt == 1101);
+        millisStubbed = 1101;
+        scriptRunner.handle();
+        scriptRunner.handle();
+        REQUIRE(first.ranAt == 1101);
+        REQUIRE(second.ranAt == 0);
+        scriptRunner.handle();
+        REQUIRE(scriptRunner.nextWakeup(wakeAt));
+        REQUIRE(wakeAt == 1104);
+    }
+
+    SECTION("with slack close wake ups are handled together") {
+        for (auto context : {
+                    &first, &second, &third, &late
+                }) {
+            context->setTimerSlack(10);
+            scriptRunner.start(*context);
+        }
+
+        scriptRunner.handle();
+        REQUIRE(scriptRunner.nextWakeup(wakeAt));
+        REQUIRE(wakeAt == 1111);
+
+        // Expired but the slack is not used up yet
+        millisStubbed = 1109;
+        scriptRunner.handle();
+        scriptRunner.handle();
+        REQUIRE(first.ranAt == 0);
+
+        millisStubbed = 1111;
+        scriptRunner.handle();
+        scriptRunner.handle();
+        REQUIRE(first.ranAt == 1111);
+        REQUIRE(second.ranAt == 1111);
+        REQUIRE(third.ranAt == 1111);
+        REQUIRE(late.ranAt == 0);
+        scriptRunner.handle();
+        REQUIRE(scriptRunner.nextWakeup(wakeAt));
+        REQUIRE(wakeAt == 1211);
+    }
+
+    SECTION("parked contexts have no wake up") {
+        ExtendedContext parked{"event=never;"};
+        SymbolTable::instance().intern("never");
+        std::vector<Command<ExtendedContext>*> eventCommands;
+        eventCommands.push_back(new Command<ExtendedContext>("event", [](const OptValue & value, ExtendedContext & context) {
+            return context.waitFor((char*)value);
+        }));
+        ScriptRunner<ExtendedContext> eventRunner(eventCommands);
+        eventRunner.start(parked);
+        eventRunner.handle();
+        REQUIRE_FALSE(eventRunner.nextWakeup(wakeAt));
+        REQUIRE(eventRunner.started());
+    }
+}
+
+TEST_CASE("Should repeat lines a number of times", "[scriptrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        uint16_t outer;
+        uint16_t inner;
+        ExtendedContext(const char* script) : Context(script), outer(0), inner(0)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("outer", [](const OptValue & value, ExtendedContext & context) {
+        context.outer++;
+        return true;
+    }));
+    commands.push_back(new Command<ExtendedContext>("inner", [](const OptValue & value, ExtendedContext & context) {
+        context.inner++;
+        return true;
+    }));
+    commands.push_back(new Command<ExtendedContext>("goto", [](const OptValue & value, ExtendedContext & context) {
+        context.jump(value);
+        return false;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+
+    SECTION("nested") {
+        ExtendedContext context{
+            "repeat=3;"
+            "outer=1;"
+            "repeat=4;"
+            "inner=1;"
+            "endrepeat;"
+            "endrepeat;"
+            "repeat=0;"
+            "outer=1;"
+            "endrepeat;"
+            "endrepeat;"};
+        REQUIRE(context.program().loops() == 3);
+
+        int ticks = 0;
+
+        while (scriptRunner.handle(context)) {
+            ticks++;
+        }
+
+        REQUIRE(context.outer == 3);
+        REQUIRE(context.inner == 12);
+        // repeat, 3 * (outer, repeat, 4 * (inner, endrepeat), endrepeat), the empty loop is gone after loading
+        REQUIRE(ticks == 1 + 3 * (3 + 4 * 2));
+        REQUIRE(context.program().size() == 7);
+    }
+
+    SECTION("jumping into a loop runs it once") {
+        ExtendedContext context{
+            "goto=in;"
+            "repeat=5;"
+            "label=in;"
+            "inner=1;"
+            "endrepeat;"};
+
+        while (scriptRunner.handle(context)) {
+        }
+
+        REQUIRE(context.inner == 1);
+    }
+
+    SECTION("restarts the count") {
+        ExtendedContext context{
+            "label=top;"
+            "outer=1;"
+            "repeat=2;"
+            "inner=1;"
+            "endrepeat;"
+            "goto=top;"};
+
+        while (context.outer < 4) {
+            scriptRunner.handle(context);
+        }
+
+        REQUIRE(context.inner == 6);
+    }
+}
+
+TEST_CASE("Should call and return from subroutines", "[scriptrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        std::string trace;
+        ExtendedContext(const char* script) : Context(script)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("trace", [](const OptValue & value, ExtendedContext & context) {
+        context.trace += (char*)value;
+        return true;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+
+    SECTION("nested") {
+        ExtendedContext context{
+            "trace=a;"
+            "call=flush;"
+            "trace=b;"
+            "call=flush;"
+            "end=1;"
+            "label=flush;"
+            "trace=<;"
+            "call=valve;"
+            "trace=>;"
+            "return=1;"
+            "label=valve;"
+            "trace=v;"
+            "return=1;"};
+
+        REQUIRE(context.program().line(1).m_opcode == Opcode::GOSUB);
+
+        while (scriptRunner.handle(context)) {
+            REQUIRE(context.callDepth() <= 2);
+        }
+
+        REQUIRE(context.trace == "a<v>b<v>");
+        REQUIRE(context.callDepth() == 0);
+    }
+
+    SECTION("too deep") {
+        ExtendedContext context{
+            "label=again;"
+            "trace=.;"
+            "call=again;"};
+
+        while (scriptRunner.handle(context)) {
+        }
+
+        REQUIRE(context.trace == std::string(SCRIPTRUNNER_CALL_DEPTH + 1, '.'));
+        REQUIRE(context.callDepth() == SCRIPTRUNNER_CALL_DEPTH);
+        context.reset();
+        REQUIRE(context.callDepth() == 0);
+    }
+
+    SECTION("return without call ends the script") {
+        ExtendedContext context{
+            "trace=a;"
+            "return=1;"
+            "trace=b;"};
+
+        while (scriptRunner.handle(context)) {
+        }
+
+        REQUIRE(context.trace == "a");
+    }
+}
+
+TEST_CASE("Should compute with registers", "[scriptrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        std::string trace;
+        ExtendedContext(const char* script) : Context(script)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("trace", [](const OptValue & value, ExtendedContext & context) {
+        context.trace += (char*)value;
+        return true;
+    }));
+    commands.push_back(new Command<ExtendedContext>("temperature", [](const OptValue & value, ExtendedContext & context) {
+        context.setRegister(1, 93);
+        return true;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+
+    SECTION("count down") {
+        ExtendedContext context{
+            "set=r0,3;"
+            "label=loop;"
+            "trace=.;"
+            "add=r0,-1;"
+            "cmp=r0,0;"
+            "jgt=loop;"
+            "trace=done;"};
+
+        while (scriptRunner.handle(context)) {
+        }
+
+        REQUIRE(context.trace == "...done");
+        REQUIRE(context.registerValue(0) == 0);
+        REQUIRE_THAT((const char*)context.program().value(context.program().line(0)), Equals("r0,3"));
+        context.reset();
+        REQUIRE(context.registerValue(0) == 0);
+    }
+
+    SECTION("thresholds") {
+        const char* script =
+            "temperature=1;"
+            "set=r2,90;"
+            "cmp=r1,r2;"
+            "jle=cold;"
+            "trace=hot;"
+            "jne=end;"
+            "label=cold;"
+            "trace=cold;"
+            "label=end;";
+        ExtendedContext context{script};
+
+        while (scriptRunner.handle(context)) {
+        }
+
+        REQUIRE(context.trace == "hot");
+        REQUIRE(context.condition(SymbolTable::JGT));
+        REQUIRE(context.condition(SymbolTable::JGE));
+        REQUIRE_FALSE(context.condition(SymbolTable::JLT));
+        REQUIRE_FALSE(context.condition(SymbolTable::JEQ));
+    }
+
+    SECTION("lines that are no register instruction go to the commands") {
+        ExtendedContext context{
+            "set=valve;"
+            "set=r99,1;"
+            "jeq=nowhere;"
+            "trace=.;"};
+
+        REQUIRE(context.program().line(0).m_opcode == Opcode::COMMAND);
+        REQUIRE(context.program().line(1).m_opcode == Opcode::COMMAND);
+        REQUIRE(context.program().line(2).m_opcode == Opcode::COMMAND);
+
+        commands.push_back(new Command<ExtendedContext>("set", [](const OptValue & value, ExtendedContext & context) {
+            context.trace += "set ";
+            context.trace += (char*)value;
+            return true;
+        }));
+        ScriptRunner<ExtendedContext> setRunner(commands);
+
+        while (setRunner.handle(context)) {
+        }
+
+        REQUIRE(context.trace == "set valveset r99,1.");
+    }
+}
+
+TEST_CASE("Should branch on command results and switch", "[scriptrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        std::string trace;
+        ExtendedContext(const char* script) : Context(script)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("trace", [](const OptValue & value, ExtendedContext & context) {
+        context.trace += (char*)value;
+        return true;
+    }));
+    commands.push_back(new Command<ExtendedContext>("door", [](const OptValue & value, ExtendedContext & context) {
+        context.setCondition(strcmp((char*)value, "open") == 0);
+        return true;
+    }));
+    commands.push_back(new Command<ExtendedContext>("select", [](const OptValue & value, ExtendedContext & context) {
+        context.setRegister(0, (int32_t)value);
+        return true;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+
+    SECTION("jtrue and jfalse") {
+        const char* script =
+            "door=open;"
+            "jfalse=closed;"
+            "trace=open;"
+            "door=closed;"
+            "jtrue=end;"
+            "label=closed;"
+            "trace=closed;"
+            "label=end;";
+        ExtendedContext context{script};
+
+        while (scriptRunner.handle(context)) {
+        }
+
+        REQUIRE(context.trace == "openclosed");
+    }
+
+    SECTION("switch") {
+        const char* menu =
+            "switch=r0,espresso,cappuccino,purge;"
+            "trace=unknown;"
+            "end=;"
+            "label=espresso;"
+            "trace=espresso;"
+            "end=;"
+            "label=cappuccino;"
+            "trace=cappuccino;"
+            "end=;"
+            "label=purge;"
+            "trace=purge;";
+        ExtendedContext context{menu};
+        REQUIRE(context.program().line(0).m_opcode == Opcode::SWITCH);
+        REQUIRE_THAT((const char*)context.program().value(context.program().line(0)),
+                     Equals("r0,espresso,cappuccino,purge"));
+
+        for (int32_t selection : {
+                    2, 0, 1, 3, -1
+                }) {
+            context.reset();
+            context.setRegister(0, selection);
+
+            while (scriptRunner.handle(context)) {
+            }
+
+            context.trace += " ";
+        }
+
+        REQUIRE(context.trace == "purge espresso cappuccino unknown unknown ");
+
+        ExtendedContext selected{"select=1;switch=r0,a,b;label=a;trace=a;label=b;trace=b;"};
+
+        while (scriptRunner.handle(selected)) {
+        }
+
+        REQUIRE(selected.trace == "b");
+    }
+
+    SECTION("a switch to a label that does not exist goes to the commands") {
+        ExtendedContext context{"switch=r0,a,nowhere;label=a;trace=a;"};
+        REQUIRE(context.program().line(0).m_opcode == Opcode::COMMAND);
+
+        while (scriptRunner.handle(context)) {
+        }
+
+        REQUIRE(context.trace == "a");
+    }
+}
+
+TEST_CASE("Should run included modules", "[scriptrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        std::string trace;
+        ExtendedContext(const char* script) : Context(script)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("trace", [](const OptValue & value, ExtendedContext & context) {
+        context.trace += (char*)value;
+        return true;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+
+    ModuleTable::instance().add("blink", "jump=skip;label=blink;repeat=2;trace=.;endrepeat;return;label=skip;");
+    ExtendedContext first{"include=blink;trace=a;call=blink;"};
+    ExtendedContext second{"include=blink;call=blink;trace=b;call=blink;"};
+    ModuleTable::instance().remove("blink");
+
+    while (scriptRunner.handle(first)) {
+    }
+
+    while (scriptRunner.handle(second)) {
+    }
+
+    REQUIRE(first.trace == "a..");
+    REQUIRE(second.trace == "..b..");
+    // Both run the lines of the same module
+    REQUIRE(&first.program().module(0) == &second.program().module(0));
+
+    // Every include has it's own loop counters
+    ModuleTable::instance().add("twice", "repeat=2;trace=t;endrepeat;");
+    ModuleTable::instance().add("outer", "trace=(;include=twice;repeat=2;trace=o;endrepeat;trace=);");
+    ExtendedContext nested{"repeat=2;include=outer;endrepeat;trace=x;include=twice;"};
+    ModuleTable::instance().remove("outer");
+    ModuleTable::instance().remove("twice");
+
+    while (scriptRunner.handle(nested)) {
+    }
+
+    REQUIRE(nested.trace == "(ttoo)(ttoo)xtt");
+    REQUIRE(nested.callDepth() == 0);
+}
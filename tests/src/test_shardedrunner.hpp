@@ -0,0 +1,150 @@
+#include <catch2/catch.hpp>
+
+#include <scriptrunner.hpp>
+#include <shardedrunner.hpp>
+#include <spscqueue.hpp>
+#include "arduinostubs.hpp"
+
+using namespace rvt::scriptrunner;
+
+TEST_CASE("Should pass items through a spsc queue in order", "[shardedrunner]") {
+    SpscQueue<int, 4> queue;
+    int item;
+
+    REQUIRE(queue.capacity() == 3);
+    REQUIRE(queue.pop(item) == false);
+    REQUIRE(queue.push(1));
+    REQUIRE(queue.push(2));
+    REQUIRE(queue.push(3));
+    REQUIRE(queue.push(4) == false);
+    REQUIRE(queue.pop(item));
+    REQUIRE(item == 1);
+    REQUIRE(queue.push(4));
+    REQUIRE(queue.pop(item));
+    REQUIRE(item == 2);
+    REQUIRE(queue.pop(item));
+    REQUIRE(item == 3);
+    REQUIRE(queue.pop(item));
+    REQUIRE(item == 4);
+    REQUIRE(queue.empty());
+}
+
+TEST_CASE("Should run contexts on independent shards", "[shardedrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        uint16_t counter;
+        size_t shard;
+        ExtendedContext* follower;
+        ExtendedContext(const char* script) : Context(script), counter(0), shard(SIZE_MAX), follower(nullptr) {
+        }
+    };
+    typedef ShardedRunner<ExtendedContext, 64> Runner;
+    Runner* runner = nullptr;
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("count", [&runner](const OptValue & value, ExtendedContext & context) {
+        context.counter++;
+        context.shard = runner->currentShard();
+        return true;
+    }));
+    // Hands the follower to the next shard
+    commands.push_back(new Command<ExtendedContext>("handover", [&runner](const OptValue & value, ExtendedContext & context) {
+        if (context.follower == nullptr) {
+            return true;
+        }
+
+        return runner->start(context.follower, (runner->currentShard() + 1) % runner->shards());
+    }));
+
+    std::vector<std::unique_ptr<ExtendedContext>> contexts;
+    std::vector<std::unique_ptr<ExtendedContext>> followers;
+
+    for (int i = 0; i < 40; i++) {
+        contexts.push_back(std::unique_ptr<ExtendedContext>(new ExtendedContext("count=1;handover=1;count=1;")));
+        followers.push_back(std::unique_ptr<ExtendedContext>(new ExtendedContext("count=1;count=1;count=1;")));
+        contexts.back()->follower = followers.back().get();
+    }
+
+    runner = new Runner(commands, 3, false);
+    REQUIRE(runner->shards() == 3);
+    REQUIRE(runner->currentShard() == Runner::NO_SHARD);
+
+    for (auto& context : contexts) {
+        while (!runner->start(context.get())) {
+        }
+    }
+
+    runner->wait();
+
+    for (size_t i = 0; i < contexts.size(); i++) {
+        REQUIRE(contexts[i]->counter == 2);
+        REQUIRE(followers[i]->counter == 3);
+        REQUIRE(contexts[i]->shard < 3);
+        REQUIRE(followers[i]->shard == (contexts[i]->shard + 1) % 3);
+    }
+
+    delete runner;
+}
+
+TEST_CASE("Should sleep and wait for events on a shard", "[shardedrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        std::atomic<uint16_t> counter;
+        ExtendedContext(const char* script) : Context(script), counter(0) {
+        }
+    };
+    typedef ShardedRunner<ExtendedContext> Runner;
+    Runner* runner = nullptr;
+    Runner* other = nullptr;
+    std::atomic<size_t> otherShard(0);
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("count", [](const OptValue & value, ExtendedContext & context) {
+        context.counter++;
+        return true;
+    }));
+    commands.push_back(new Command<ExtendedContext>("await", [](const OptValue & value, ExtendedContext & context) {
+        return context.waitFor((char*)value);
+    }));
+    // The shard of this thread is only known to the runner it belongs to
+    commands.push_back(new Command<ExtendedContext>("other", [&other, &otherShard](const OptValue & value,
+    ExtendedContext & context) {
+        otherShard = other->currentShard();
+        return true;
+    }));
+
+    SymbolId go = SymbolTable::instance().intern("go");
+    ExtendedContext sleeper("count=1;wait=10;count=1;other=1;");
+    ExtendedContext waiter("count=1;await=go;count=1;");
+
+    runner = new Runner(commands, 2, false);
+    other = new Runner(commands, 1, false);
+    millisStubbed = 0;
+    REQUIRE(runner->start(&sleeper, 0));
+    REQUIRE(runner->start(&waiter, 1));
+
+    while (sleeper.counter != 1 || waiter.counter != 1) {
+        std::this_thread::yield();
+    }
+
+    // Both shards sleep now, nothing runs until time passes or the event is signalled
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    REQUIRE(sleeper.counter == 1);
+    REQUIRE(waiter.counter == 1);
+    REQUIRE(runner->idle() == false);
+
+    // Signals are not remembered, so signal until the waiter saw it
+    while (waiter.counter != 2) {
+        REQUIRE(runner->signal(go));
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    millisStubbed = 20;
+    runner->wait();
+
+    REQUIRE(sleeper.counter == 2);
+    REQUIRE(otherShard == Runner::NO_SHARD);
+
+    delete other;
+    delete runner;
+}
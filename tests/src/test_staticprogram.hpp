@@ -0,0 +1,196 @@
+#include <catch2/catch.hpp>
+
+#include <staticprogram.hpp>
+#include <string>
+#include "arduinostubs.hpp"
+#include "recipe_script.hpp"
+using Catch::Matchers::Equals;
+
+using namespace rvt::scriptrunner;
+
+static constexpr auto s_recipe = SCRIPTRUNNER_STATIC_SCRIPT(RECIPE_SCRIPT);
+
+// Parsed by the compiler
+static_assert(s_recipe.size() == 25, "a line for every instruction and the end");
+static_assert(s_recipe.line(0).m_opcode == Opcode::SET && s_recipe.line(0).m_immediate == 3, "operands are parsed");
+static_assert(s_recipe.line(6).m_opcode == Opcode::BRANCH && s_recipe.line(6).m_target == 2, "jumps go past the label");
+static_assert(s_recipe.line(9).m_opcode == Opcode::ENDREPEAT && s_recipe.line(9).m_target == 8, "loops are linked");
+static_assert(s_recipe.line(14).m_opcode == Opcode::SWITCH && s_recipe.line(14).m_count == 2, "switches are resolved");
+static_assert(s_recipe.line(18).m_opcode == Opcode::GOSUB && s_recipe.line(18).m_target == 22, "calls are resolved");
+static_assert(s_recipe.line(24).m_opcode == Opcode::END, "the program ends with end");
+
+TEST_CASE("Should parse a script at compile time", "[staticprogram]") {
+    for (SymbolId id = SymbolTable::EMPTY; id <= SymbolTable::LAST_INSTRUCTION; id++) {
+        REQUIRE_THAT(detail::s_builtins[id], Equals(SymbolTable::instance().name(id)));
+    }
+
+    REQUIRE_THAT(s_recipe.string(s_recipe.line(2).m_key), Equals("trace"));
+    REQUIRE_THAT(s_recipe.string(s_recipe.line(2).m_value), Equals("."));
+    REQUIRE_THAT(s_recipe.string(s_recipe.line(22).m_key), Equals("trace"));
+    REQUIRE_THAT(s_recipe.string(s_recipe.line(22).m_value), Equals("s"));
+    REQUIRE_THAT(s_recipe.string(s_recipe.line(23).m_value), Equals(""));
+    REQUIRE(s_recipe.line(3).m_count == 10);
+    REQUIRE(s_recipe.loops() == 1);
+
+    constexpr auto spaced = SCRIPTRUNNER_STATIC_SCRIPT(" trace = s ;");
+    REQUIRE_THAT(spaced.string(spaced.line(0).m_key), Equals("trace"));
+    REQUIRE_THAT(spaced.string(spaced.line(0).m_value), Equals("s"));
+
+    constexpr auto fallback = SCRIPTRUNNER_STATIC_SCRIPT("set=valve;jeq=nowhere;switch=r0,nowhere;repeat=0;a=1;endrepeat;");
+    REQUIRE(fallback.line(0).m_opcode == Opcode::COMMAND);
+    REQUIRE(fallback.line(1).m_opcode == Opcode::COMMAND);
+    REQUIRE(fallback.line(2).m_opcode == Opcode::COMMAND);
+    REQUIRE(fallback.line(3).m_opcode == Opcode::GOTO);
+    REQUIRE(fallback.line(3).m_target == 6);
+}
+
+TEST_CASE("Should run a compile time parsed script like the interpreter", "[staticprogram]") {
+    class ExtendedContext : public Context {
+    public:
+        std::string trace;
+        ExtendedContext() {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("trace", [](const OptValue & value, ExtendedContext & context) {
+        context.trace += (char*)value;
+        return true;
+    }));
+    commands.push_back(new Command<ExtendedContext>("goto", [](const OptValue & value, ExtendedContext & context) {
+        context.jump(value);
+        return false;
+    }));
+    commands.push_back(new Command<ExtendedContext>("select", [](const OptValue & value, ExtendedContext & context) {
+        context.setRegister(1, (int32_t)value);
+        return true;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+
+    ExtendedContext context;
+    runStatic<s_recipe>(context);
+    millisStubbed = 0;
+
+    while (scriptRunner.handle(context)) {
+        millisStubbed++;
+    }
+
+    REQUIRE(context.trace == "...rrsdone");
+    REQUIRE(context.registerValue(0) == 0);
+    REQUIRE(context.hasProgram() == false);
+    REQUIRE(millisStubbed > 30);
+
+    context.reset();
+    context.trace.clear();
+
+    while (scriptRunner.handle(context)) {
+        millisStubbed++;
+    }
+
+    REQUIRE(context.trace == "...rrsdone");
+}
+
+/**
+ * Stands in for flash on the host, every read of the program goes through copy()
+ */
+struct CountingMemory {
+    static size_t s_reads;
+
+    static void copy(void* destination, const void* source, size_t size) {
+        s_reads++;
+        memcpy(destination, source, size);
+    }
+
+    static const char* string(const char* source, char* buffer, size_t size) {
+        s_reads++;
+        strncpy(buffer, source, size - 1);
+        buffer[size - 1] = '\0';
+        return buffer;
+    }
+};
+
+size_t CountingMemory::s_reads = 0;
+
+static constexpr auto s_flashRecipe = SCRIPTRUNNER_STATIC_SCRIPT(
+        "select=1;"
+        "switch=r1,one,two;"
+        "label=one;"
+        "trace=one;"
+        "label=two;"
+        "goto=sub;"
+        "trace=never;"
+        "label=sub;"
+        "trace= a value that is copied into a buffer ;");
+
+// Longer keys and values would be cut off when copied out of program memory, so they don't compile
+static_assert(staticLongest(" trace = a value that is copied into a buffer ;x") == 36, "white space is not counted");
+static_assert(staticLongest("trace=a value that is longer than the buffer it is copied into, which cuts it off;") >=
+              SCRIPTRUNNER_STRING_BUFFER, "SCRIPTRUNNER_STATIC_SCRIPT rejects this script");
+
+TEST_CASE("Should run the first line after a label a command jumped to in a static program", "[staticprogram]") {
+    class ExtendedContext : public Context {
+    public:
+        std::string trace;
+        ExtendedContext() {
+        }
+    };
+
+    static constexpr auto jumping = SCRIPTRUNNER_STATIC_SCRIPT("go=there;trace=skipped;label=there;trace=run;");
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("trace", [](const OptValue & value, ExtendedContext & context) {
+        context.trace += (char*)value;
+        return true;
+    }));
+    commands.push_back(new Command<ExtendedContext>("go", [](const OptValue & value, ExtendedContext & context) {
+        context.jump(value);
+        return true;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+
+    ExtendedContext context;
+    runStatic<jumping>(context);
+
+    while (scriptRunner.handle(context)) {
+    }
+
+    REQUIRE(context.trace == "run");
+}
+
+TEST_CASE("Should run a static program through a memory accessor", "[staticprogram]") {
+    class ExtendedContext : public Context {
+    public:
+        std::string trace;
+        ExtendedContext() {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("trace", [](const OptValue & value, ExtendedContext & context) {
+        context.trace += (char*)value;
+        return true;
+    }));
+    commands.push_back(new Command<ExtendedContext>("goto", [](const OptValue & value, ExtendedContext & context) {
+        context.jump(value);
+        return false;
+    }));
+    commands.push_back(new Command<ExtendedContext>("select", [](const OptValue & value, ExtendedContext & context) {
+        context.setRegister(1, (int32_t)value);
+        return true;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+
+    ExtendedContext context;
+    CountingMemory::s_reads = 0;
+    runStatic<s_flashRecipe, CountingMemory>(context);
+    REQUIRE(CountingMemory::s_reads > 0);
+
+    size_t ticks = 0;
+    CountingMemory::s_reads = 0;
+
+    while (scriptRunner.handle(context)) {
+        ticks++;
+    }
+
+    REQUIRE(context.trace == "a value that is copied into a buffer");
+    REQUIRE(CountingMemory::s_reads > ticks);
+}
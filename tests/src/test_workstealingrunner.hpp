@@ -0,0 +1,125 @@
+#include <catch2/catch.hpp>
+
+#include <scriptrunner.hpp>
+#include <workstealingrunner.hpp>
+#include "arduinostubs.hpp"
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace rvt::scriptrunner;
+
+TEST_CASE("Should run all contexts to the end on a thread pool", "[workstealingrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        uint16_t counter;
+        uint16_t loops;
+        ExtendedContext(const char* script) : Context(script), counter(0), loops(0)  {
+        }
+    };
+
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("count", [](const OptValue & value, ExtendedContext & context) {
+        context.counter++;
+        return true;
+    }));
+    commands.push_back(new Command<ExtendedContext>("loop", [](const OptValue & value, ExtendedContext & context) {
+        if (++context.loops < 20) {
+            context.jump("top");
+            return false;
+        }
+
+        return true;
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+
+    std::vector<std::unique_ptr<ExtendedContext>> contexts;
+
+    for (int i = 0; i < 200; i++) {
+        contexts.push_back(std::unique_ptr<ExtendedContext>(new ExtendedContext(
+                               "label=top;"
+                               "count=1;"
+                               "count=1;"
+                               "loop=1;")));
+    }
+
+    WorkStealingRunner<ExtendedContext> runner(scriptRunner, 4);
+    REQUIRE(runner.threads() == 4);
+
+    for (auto& context : contexts) {
+        runner.start(context.get());
+    }
+
+    runner.wait();
+    REQUIRE(runner.running() == 0);
+
+    for (auto& context : contexts) {
+        REQUIRE(context->counter == 40);
+        REQUIRE(scriptRunner.handle(*context) == false);
+    }
+}
+
+TEST_CASE("Should park sleeping and waiting contexts on a thread pool", "[workstealingrunner]") {
+    class ExtendedContext : public Context {
+    public:
+        std::atomic<uint16_t> polls;
+        ExtendedContext(const char* script) : Context(script), polls(0)  {
+        }
+    };
+
+    const SymbolId ready = SymbolTable::instance().intern("ready");
+    std::vector<Command<ExtendedContext>*> commands;
+    commands.push_back(new Command<ExtendedContext>("nap", [](const OptValue & value, ExtendedContext & context) {
+        return context.polls++ == 0 ? CommandResult::sleepFor(20) : CommandResult::advance();
+    }));
+    commands.push_back(new Command<ExtendedContext>("await", [](const OptValue & value, ExtendedContext & context) {
+        context.polls++;
+        return context.waitFor((const char*)value);
+    }));
+    ScriptRunner<ExtendedContext> scriptRunner(commands);
+    millisStubbed = 0;
+
+    ExtendedContext napping{"nap=1;"};
+    ExtendedContext waiting{"await=ready;"};
+    WorkStealingRunner<ExtendedContext> runner(scriptRunner, 2);
+    runner.start(&napping);
+    runner.start(&waiting);
+
+    // Spinning workers would handle the contexts thousands of times meanwhile
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    REQUIRE(napping.polls == 1);
+    REQUIRE(waiting.polls == 1);
+    REQUIRE(runner.running() == 2);
+
+    // The napping worker wakes up at it's timer and sees it's due
+    runner.signal(ready);
+    millisStubbed = 20;
+    runner.wait();
+
+    REQUIRE(napping.polls == 2);
+    REQUIRE(waiting.polls == 2);
+    REQUIRE(runner.running() == 0);
+}
+
+TEST_CASE("Should run a context signalled while waiting for the pool", "[workstealingrunner]") {
+    const SymbolId event = SymbolTable::instance().intern("ev");
+    std::vector<Command<Context>*> commands;
+    commands.push_back(new Command<Context>("waitfor", [](const OptValue & value, Context & context) {
+        return context.waitFor((const char*)value);
+    }));
+    ScriptRunner<Context> scriptRunner(commands);
+
+    Context context{"waitfor=ev;"};
+    WorkStealingRunner<Context> runner(scriptRunner, 1);
+    runner.start(&context);
+
+    // The wake up for the worker must not go to the thread in wait()
+    std::thread signaller([&runner, event]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        runner.signal(event);
+    });
+
+    runner.wait();
+    signaller.join();
+    REQUIRE(runner.running() == 0);
+}
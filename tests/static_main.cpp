@@ -0,0 +1,6 @@
+// Tests for the optional C++17 compile time parsed scripts
+
+#define CATCH_CONFIG_MAIN
+
+#include "catch2/catch.hpp"
+#include "src/test_staticprogram.hpp"